@@ -18,22 +18,51 @@
 #include "nd.h"
 /*---------------------------------------------------------------------------*/
 static void
-nd_new_nbr_cb(uint16_t epoch, uint8_t nbr_id)
+nd_new_nbr_cb(struct nd_instance *nd, uint16_t epoch, uint16_t nbr_id)
 {
   printf("App: Epoch %u New NBR %u\n",
     epoch, nbr_id);
 }
 /*---------------------------------------------------------------------------*/
 static void
-nd_epoch_end_cb(uint16_t epoch, uint8_t num_nbr)
+nd_epoch_end_cb(struct nd_instance *nd, uint16_t epoch, uint8_t num_nbr)
 {
-  printf("App: Epoch %u finished Num NBR %u\n",
-    epoch, num_nbr);
+  const struct nd_rx_stats *st = nd_instance_get_rx_stats(nd);
+
+  printf("App: Epoch %u finished Num NBR %u TXP %d\n",
+    epoch, num_nbr, nd_instance_get_txpower(nd));
+  printf("App: Epoch %u RX %u win %u len %u id %u self %u dup %u crc %u ext %u flush %u rep %u data %u\n",
+    epoch, st->rx, st->not_window, st->bad_len, st->bad_id, st->self_id,
+    st->dup, st->badcrc, st->extended, st->flushed, st->replied, st->data);
+}
+/*---------------------------------------------------------------------------*/
+static void
+nd_nbr_joined_cb(struct nd_instance *nd, uint16_t epoch, uint16_t nbr_id)
+{
+  printf("App: Epoch %u NBR %u joined\n",
+    epoch, nbr_id);
+}
+/*---------------------------------------------------------------------------*/
+static void
+nd_nbr_lost_cb(struct nd_instance *nd, uint16_t epoch, uint16_t nbr_id)
+{
+  printf("App: Epoch %u NBR %u lost\n",
+    epoch, nbr_id);
+}
+/*---------------------------------------------------------------------------*/
+static void
+nd_data_cb(struct nd_instance *nd, uint16_t epoch, uint16_t src, const void *data, uint8_t len)
+{
+  printf("App: Epoch %u Data from %u len %u\n",
+    epoch, src, len);
 }
 /*---------------------------------------------------------------------------*/
 struct nd_callbacks rcb = {
   .nd_new_nbr = nd_new_nbr_cb,
-  .nd_epoch_end = nd_epoch_end_cb};
+  .nd_epoch_end = nd_epoch_end_cb,
+  .nd_nbr_joined = nd_nbr_joined_cb,
+  .nd_nbr_lost = nd_nbr_lost_cb,
+  .nd_data = nd_data_cb};
 /*---------------------------------------------------------------------------*/
 PROCESS(app_process, "Application process");
 AUTOSTART_PROCESSES(&app_process);
@@ -82,6 +111,10 @@ PROCESS_THREAD(app_process, ev, data)
   /* Start ND Primitive */
   nd_start(ND_BURST, &rcb);
   // nd_start(ND_SCATTER, &rcb);
+  // nd_start(ND_BURST | ND_CONTINUOUS, &rcb);
+  // nd_start(ND_BURST | ND_ADAPTIVE, &rcb);
+  // nd_start(ND_BURST | ND_REACTIVE, &rcb);
+  // nd_start(ND_BURST | ND_TXPOWER, &rcb);
 
   /* Do nothing else */
   while (1) {
@@ -11,6 +11,10 @@ import math
 
 nodes = []
 
+# Receive statistics counters, in the order printed by the application
+rx_keys = ['rx', 'win', 'len', 'id', 'self', 'dup', 'crc', 'ext', 'flush', 'rep', 'data']
+rx_keys_min = 9
+
 def parse_file(log_file, testbed=False):
     # Print some basic information for the user
     print(f"Logfile: {log_file}")
@@ -20,13 +24,20 @@ def parse_file(log_file, testbed=False):
     if testbed:
         # Regex for testbed experiments
         testbed_record_pattern = r"\[(?P<time>.{23})\] INFO:firefly\.(?P<self_id>\d+): \d+\.firefly < b"
-        regex_num_nbr = re.compile(r"{}'.*Epoch (?P<epoch_num>\d+) finished Num NBR (?P<num_nbr>\d+)".format(testbed_record_pattern))
+        regex_num_nbr = re.compile(r"{}'.*Epoch (?P<epoch_num>\d+) finished Num NBR (?P<num_nbr>\d+)(?: TXP (?P<txp>-?\d+))?".format(testbed_record_pattern))
+        record_pattern = testbed_record_pattern + "'"
     else:
         # Regular expressions for COOJA
         record_pattern = r"(?P<time>[\w:.]+)\s+ID:(?P<self_id>\d+)\s+"
-        regex_num_nbr = re.compile(r"{}.*Epoch (?P<epoch_num>\d+) finished Num NBR (?P<num_nbr>\d+)".format(record_pattern))
+        regex_num_nbr = re.compile(r"{}.*Epoch (?P<epoch_num>\d+) finished Num NBR (?P<num_nbr>\d+)(?: TXP (?P<txp>-?\d+))?".format(record_pattern))
+    # counters after rx_keys_min are optional, older logs do not have them
+    regex_rx = re.compile(r"{}.*Epoch (?P<epoch_num>\d+) RX (?P<rx>\d+)".format(record_pattern) +
+                          "".join(r" {} (?P<{}>\d+)".format(k, k) if i < rx_keys_min
+                                  else r"(?: {} (?P<{}>\d+))?".format(k, k)
+                                  for i, k in enumerate(rx_keys) if k != 'rx'))
 
     data = {}
+    rx_data = {}
 
     epochs = 0
 
@@ -35,7 +46,19 @@ def parse_file(log_file, testbed=False):
     # Parse log file and add data to CSV files
     with open(log_file, 'r') as f:
         for line in f:
-            
+
+            m = regex_rx.match(line)
+            if m:
+                d = m.groupdict()
+                nid = int(d['self_id'])
+                if rx_data.get(nid) is None:
+                    rx_data[nid] = {k: 0 for k in rx_keys}
+                    rx_data[nid]['epochs'] = 0
+                for k in rx_keys:
+                    rx_data[nid][k] += int(d[k] or 0)
+                rx_data[nid]['epochs'] += 1
+                continue
+
             m = regex_num_nbr.match(line)
             if m:
                 d = m.groupdict()
@@ -57,12 +80,15 @@ def parse_file(log_file, testbed=False):
                         'epoch_num': 0,
                         'num_nbr': [],
                         'total_nbr': 0,
+                        'txp': [],
                     }
 
                 data[d['self_id']]['epoch_num'] = d['epoch_num']
 
                 data[d['self_id']]['num_nbr'].append(d['num_nbr'])
                 data[d['self_id']]['total_nbr'] += d['num_nbr']
+                if d['txp'] is not None:
+                    data[d['self_id']]['txp'].append(int(d['txp']))
 
     if testbed: 
         print(f"Time: {time}")
@@ -96,6 +122,40 @@ def parse_file(log_file, testbed=False):
                                                         dc_std, dc_min,
                                                         dc_max))
 
+    txp = [p for v in data.values() for p in v['txp']]
+    if txp:
+        print("Average TX Power: {:.2f} dBm (min {}, max {})\n".format(
+            sum(txp) / len(txp), min(txp), max(txp)))
+
+    if rx_data:
+        print_rx_stats(data, rx_data)
+
+
+def print_rx_stats(data, rx_data):
+    # Frames that led to a new discovery vs frames that cost energy for nothing
+    totals = {k: 0 for k in rx_keys}
+    total_new = 0
+    total_epochs = 0
+
+    print("----- Receive Statistics (per epoch) -----\n")
+    print("Node " + " ".join("{:>6}".format(k) for k in rx_keys) + "    new useful")
+    for nid in sorted(rx_data.keys()):
+        v = rx_data[nid]
+        new = data[nid]['total_nbr'] if data.get(nid) else 0
+        useful = new / v['rx'] if v['rx'] else 0
+        print("{:<4} ".format(nid) +
+              " ".join("{:>6.2f}".format(v[k] / v['epochs']) for k in rx_keys) +
+              " {:>6.2f} {:>6.2%}".format(new / v['epochs'], useful))
+
+        for k in rx_keys:
+            totals[k] += v[k]
+        total_new += new
+        total_epochs += v['epochs']
+
+    print("\nAll  " + " ".join("{:>6.2f}".format(totals[k] / total_epochs) for k in rx_keys) +
+          " {:>6.2f} {:>6.2%}\n".format(total_new / total_epochs,
+                                        total_new / totals['rx'] if totals['rx'] else 0))
+
 
 def parse_args():
     parser = argparse.ArgumentParser()
@@ -0,0 +1,321 @@
+#!/usr/bin/env python3
+
+# Generate Cooja simulations (.csc) for the ND application.
+#
+# Examples:
+#   python3 gen-scenario.py -n 156 --density 4 --layout random -o nd-test-mrm-156n.csc
+#   python3 gen-scenario.py -n 300 --area 500 500 --layout clustered --clusters 6 \
+#     --radio udgm --tx-range 50 -o nd-test-udgm-300n.csc
+#   python3 gen-scenario.py -n 50 --area 300 300 --mobility random-waypoint \
+#     --speed 0.5 2 -o nd-test-mrm-50n-mob.csc
+#
+# The simulation keeps the log-capture script of the hand-written scenarios:
+# every mote message goes to test.log and the PowerTracker stats to
+# test_dc.log, so discovery.py and energest-stats.py work unchanged.
+
+import os
+import sys
+import math
+import random
+import argparse
+
+MOTE_INTERFACES = [
+    "org.contikios.cooja.interfaces.Position",
+    "org.contikios.cooja.interfaces.RimeAddress",
+    "org.contikios.cooja.interfaces.IPAddress",
+    "org.contikios.cooja.interfaces.Mote2MoteRelations",
+    "org.contikios.cooja.interfaces.MoteAttributes",
+    "org.contikios.cooja.mspmote.interfaces.MspClock",
+    "org.contikios.cooja.mspmote.interfaces.MspMoteID",
+    "org.contikios.cooja.mspmote.interfaces.SkyButton",
+    "org.contikios.cooja.mspmote.interfaces.SkyFlash",
+    "org.contikios.cooja.mspmote.interfaces.SkyCoffeeFilesystem",
+    "org.contikios.cooja.mspmote.interfaces.Msp802154Radio",
+    "org.contikios.cooja.mspmote.interfaces.MspSerial",
+    "org.contikios.cooja.mspmote.interfaces.SkyLED",
+    "org.contikios.cooja.mspmote.interfaces.MspDebugOutput",
+    "org.contikios.cooja.mspmote.interfaces.SkyTemperature",
+]
+
+# Same script as the nd-test-mrm-*.csc files, only the timeout is a parameter
+SCRIPT = """SIM_SETTLING_TIME = 1000
+        TIMEOUT(%d);
+        try {
+          load("nashorn:mozilla_compat.js");
+        } catch(err) {}
+
+        //import Java Package to JavaScript
+        importPackage(java.io);
+
+        importPackage(java.util);
+
+        allm = sim.getMotes();
+        nmotes = allm.length;
+
+        ptplugin = sim.getCooja().getStartedPlugin("PowerTracker");
+        ptplugin.reset();
+
+        outputs = new FileWriter("test.log");
+        dcoutputs = new FileWriter("test_dc.log");
+
+        // Generate a message to reset the powertracker stats after SIM_SETTLING_TIME
+        GENERATE_MSG(SIM_SETTLING_TIME, "Simulation Settling Time");
+
+        while (true) {
+          if(msg.equals("Simulation Settling Time")) {
+            ptplugin.reset();
+          } else {
+            //Write to file.
+            outputs.write(time + "\\tID:" + id + "\\t" + msg + "\\n");
+          }
+
+          try{
+            //This is the tricky part. The Script is terminated using
+            // an exception. This needs to be caught.
+              YIELD();
+          } catch (e) {
+            // Get the PowerTracker Stats
+            stats = ptplugin.radioStatistics();
+            dcoutputs.write(stats + "\\n");
+
+            //Close files.
+            outputs.close();
+            dcoutputs.close();
+
+            //Rethrow exception again, to end the script.
+            throw('test script killed');
+          }
+        }"""
+
+
+def layout_grid(n, w, h, rnd):
+    cols = max(1, int(math.ceil(math.sqrt(n * w / h))))
+    rows = int(math.ceil(n / cols))
+    dx = w / cols
+    dy = h / rows
+    return [((i % cols + 0.5) * dx, (i // cols + 0.5) * dy) for i in range(n)]
+
+
+def layout_random(n, w, h, rnd):
+    return [(rnd.uniform(0, w), rnd.uniform(0, h)) for _ in range(n)]
+
+
+def layout_clustered(n, w, h, rnd, clusters, spread):
+    centers = [(rnd.uniform(0, w), rnd.uniform(0, h)) for _ in range(clusters)]
+    pos = []
+    for i in range(n):
+        cx, cy = centers[i % clusters]
+        x = min(max(rnd.gauss(cx, spread), 0), w)
+        y = min(max(rnd.gauss(cy, spread), 0), h)
+        pos.append((x, y))
+    return pos
+
+
+def random_waypoint(pos, w, h, rnd, duration, speed, pause, step):
+    # Trace format of the Cooja mobility plugin: "<mote index> <time s> <x> <y>".
+    # The plugin replays the entries in file order, so they are sorted by time
+    moves = []
+    for i, (x, y) in enumerate(pos):
+        t = 0.0
+        moves.append((t, i, x, y))
+        while t < duration:
+            tx, ty = rnd.uniform(0, w), rnd.uniform(0, h)
+            v = rnd.uniform(speed[0], speed[1])
+            dist = math.hypot(tx - x, ty - y)
+            steps = max(1, int(dist / (v * step)))
+            for s in range(1, steps + 1):
+                t += dist / v / steps
+                moves.append((t, i, x + (tx - x) * s / steps, y + (ty - y) * s / steps))
+            x, y = tx, ty
+            t += pause
+    moves.sort(key=lambda m: (m[0], m[1]))
+    return ["%d %.2f %.2f %.2f" % (i, t, x, y) for t, i, x, y in moves]
+
+
+def radio_medium(args):
+    if args.radio == 'udgm':
+        return """      org.contikios.cooja.radiomediums.UDGM
+      <transmitting_range>%.1f</transmitting_range>
+      <interference_range>%.1f</interference_range>
+      <success_ratio_tx>%.2f</success_ratio_tx>
+      <success_ratio_rx>%.2f</success_ratio_rx>""" % (
+            args.tx_range, args.interference_range or 2 * args.tx_range,
+            args.success_tx, args.success_rx)
+
+    # MRM channel model parameters, e.g. --mrm-param tx_power=0.0
+    params = "".join("\n      <%s>%s</%s>" % (k, v, k)
+                     for k, v in (p.split('=', 1) for p in args.mrm_param))
+    return """      org.contikios.mrm.MRM
+      <obstacles />""" + params
+
+
+def mote(i, x, y):
+    return """    <mote>
+      <breakpoints />
+      <interface_config>
+        org.contikios.cooja.interfaces.Position
+        <x>%s</x>
+        <y>%s</y>
+        <z>0.0</z>
+      </interface_config>
+      <interface_config>
+        org.contikios.cooja.mspmote.interfaces.MspClock
+        <deviation>1.0</deviation>
+      </interface_config>
+      <interface_config>
+        org.contikios.cooja.mspmote.interfaces.MspMoteID
+        <id>%d</id>
+      </interface_config>
+      <motetype_identifier>sky1</motetype_identifier>
+    </mote>
+""" % (repr(x), repr(y), i)
+
+
+def plugin(name, config="", width=400, height=200, x=0, y=0, z=0, minimized=False):
+    return """  <plugin>
+    %s
+%s    <width>%d</width>
+    <z>%d</z>
+    <height>%d</height>
+    <location_x>%d</location_x>
+    <location_y>%d</location_y>
+%s  </plugin>
+""" % (name, config, width, z, height, x, y, "    <minimized>true</minimized>\n" if minimized else "")
+
+
+def generate(args):
+    rnd = random.Random(args.seed)
+
+    if args.density:
+        # nodes per 100m x 100m, square area
+        side = 100 * math.sqrt(args.nodes / args.density)
+        w, h = side, side
+    else:
+        w, h = args.area
+
+    if args.layout == 'grid':
+        pos = layout_grid(args.nodes, w, h, rnd)
+    elif args.layout == 'random':
+        pos = layout_random(args.nodes, w, h, rnd)
+    else:
+        pos = layout_clustered(args.nodes, w, h, rnd, args.clusters,
+                               args.spread or min(w, h) / (2 * args.clusters))
+
+    projects = ["mrm", "mspsim", "avrora", "serial_socket", "powertracker"]
+    plugins = ""
+    trace = None
+
+    if args.mobility:
+        projects.append("mobility")
+        if args.mobility == 'random-waypoint':
+            trace = os.path.splitext(args.output)[0] + "-positions.dat"
+            lines = random_waypoint(pos, w, h, rnd, args.duration, args.speed, args.pause, args.step)
+            with open(trace, 'w') as f:
+                f.write("\n".join(lines) + "\n")
+        else:
+            trace = args.mobility
+        plugins += plugin("Mobility", """    <plugin_config>
+      <positions EXPORT="copy">[CONFIG_DIR]/%s</positions>
+    </plugin_config>
+""" % os.path.relpath(trace, os.path.dirname(os.path.abspath(args.output))), minimized=True)
+
+    if args.gui:
+        plugins += plugin("org.contikios.cooja.plugins.Visualizer", """    <plugin_config>
+      <moterelations>true</moterelations>
+      <skin>org.contikios.cooja.plugins.skins.IDVisualizerSkin</skin>
+      <skin>%s</skin>
+    </plugin_config>
+""" % ("org.contikios.mrm.MRMVisualizerSkin" if args.radio == 'mrm'
+       else "org.contikios.cooja.plugins.skins.UDGMVisualizerSkin"), width=400, height=400)
+        plugins += plugin("org.contikios.cooja.plugins.LogListener", """    <plugin_config>
+      <filter>finished</filter>
+      <formatted_time />
+      <coloring />
+    </plugin_config>
+""", width=787, height=241, x=398, y=160, z=3)
+
+    plugins += plugin("PowerTracker", x=132, y=152, z=-1, width=400, height=155, minimized=True)
+    plugins += plugin("org.contikios.cooja.plugins.ScriptRunner", """    <plugin_config>
+      <script>%s</script>
+      <active>true</active>
+    </plugin_config>
+""" % (SCRIPT % (args.duration * 1000)), width=600, height=700, x=1184, y=1, z=5)
+    plugins += plugin("org.contikios.cooja.plugins.SimControl", width=280, height=160, x=397, z=1)
+
+    csc = """<?xml version="1.0" encoding="UTF-8"?>
+<simconf>
+%s  <simulation>
+    <title>%s</title>
+    <randomseed>generated</randomseed>
+    <motedelay_us>2000000</motedelay_us>
+    <radiomedium>
+%s
+    </radiomedium>
+    <events>
+      <logoutput>40000</logoutput>
+    </events>
+    <motetype>
+      org.contikios.cooja.mspmote.SkyMoteType
+      <identifier>sky1</identifier>
+      <description>Sky Mote Type #sky1</description>
+      <firmware EXPORT="copy">[CONFIG_DIR]/app.sky</firmware>
+%s    </motetype>
+%s  </simulation>
+%s</simconf>
+""" % ("".join('  <project EXPORT="discard">[APPS_DIR]/%s</project>\n' % p for p in projects),
+       "ND %d nodes %s %s" % (args.nodes, args.layout, args.radio),
+       radio_medium(args),
+       "".join("      <moteinterface>%s</moteinterface>\n" % i for i in MOTE_INTERFACES),
+       "".join(mote(i + 1, x, y) for i, (x, y) in enumerate(pos)),
+       plugins)
+
+    with open(args.output, 'w') as f:
+        f.write(csc)
+
+    print(f"{args.output}: {args.nodes} nodes, {w:.0f}x{h:.0f}m, {args.layout}, {args.radio}, "
+          f"{args.duration}s" + (f", mobility {trace}" if trace else ""))
+
+
+def parse_args():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('-n', '--nodes', type=int, required=True,
+                        help="number of motes, ids are 1..n")
+    area = parser.add_mutually_exclusive_group(required=True)
+    area.add_argument('--area', type=float, nargs=2, metavar=('W', 'H'),
+                      help="deployment area in meters")
+    area.add_argument('--density', type=float,
+                      help="nodes per 100m x 100m, the area is a square")
+    parser.add_argument('--layout', choices=['grid', 'random', 'clustered'], default='random')
+    parser.add_argument('--clusters', type=int, default=4,
+                        help="number of clusters (clustered layout)")
+    parser.add_argument('--spread', type=float,
+                        help="standard deviation of the distance from the cluster center (m)")
+    parser.add_argument('--radio', choices=['mrm', 'udgm'], default='mrm')
+    parser.add_argument('--mrm-param', action='append', default=[], metavar='NAME=VALUE',
+                        help="MRM channel model parameter, e.g. tx_power=0.0 (repeatable)")
+    parser.add_argument('--tx-range', type=float, default=50.0, help="UDGM transmission range (m)")
+    parser.add_argument('--interference-range', type=float, help="UDGM interference range (m), default 2x tx range")
+    parser.add_argument('--success-tx', type=float, default=1.0, help="UDGM TX success ratio")
+    parser.add_argument('--success-rx', type=float, default=1.0, help="UDGM RX success ratio")
+    parser.add_argument('--mobility', metavar='random-waypoint|TRACE',
+                        help="generate a random waypoint trace or use an existing mobility plugin trace")
+    parser.add_argument('--speed', type=float, nargs=2, default=[0.5, 1.5], metavar=('MIN', 'MAX'),
+                        help="random waypoint speed range (m/s)")
+    parser.add_argument('--pause', type=float, default=10.0, help="random waypoint pause time (s)")
+    parser.add_argument('--step', type=float, default=1.0, help="random waypoint trace resolution (s)")
+    parser.add_argument('-d', '--duration', type=int, default=180, help="simulation duration (s)")
+    parser.add_argument('-s', '--seed', type=int, default=1, help="seed for positions and mobility")
+    parser.add_argument('--gui', action='store_true', help="add Visualizer and LogListener plugins")
+    parser.add_argument('-o', '--output', required=True, help="output .csc file")
+    return parser.parse_args()
+
+
+if __name__ == '__main__':
+
+    args = parse_args()
+
+    if args.nodes < 1:
+        print("The number of nodes must be positive.")
+        sys.exit(1)
+
+    generate(args)
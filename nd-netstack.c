@@ -2,11 +2,13 @@
 #include "net/netstack.h"
 #include "nd-netstack.h"
 #include <stdio.h>
+#include "nd.h"
 /*---------------------------------------------------------------------------*/
 static void
 input(void)
 {
-  /* Nothing */
+  /* Payloads piggybacked on ND beacons */
+  nd_data_input();
 }
 /*---------------------------------------------------------------------------*/
 static void
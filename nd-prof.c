@@ -0,0 +1,165 @@
+/*---------------------------------------------------------------------------*/
+#include "contiki.h"
+#include "sys/rtimer.h"
+/*---------------------------------------------------------------------------*/
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+/*---------------------------------------------------------------------------*/
+#include "nd-prof.h"
+/*---------------------------------------------------------------------------*/
+#if ND_PROF_ENABLED
+/*---------------------------------------------------------------------------*/
+struct hist {
+  uint16_t count;
+  uint32_t min;
+  uint32_t max;
+  uint16_t buckets[ND_PROF_BUCKETS];
+};
+
+struct cb_stats {
+  struct hist dur;  /* entry to exit, ND_PROF_SECOND units */
+  struct hist late; /* scheduled to actual firing, RTIMER_SECOND units */
+};
+
+static const char *cb_names[ND_PROF_NUM] = {
+  "nd_recv",
+  "burst_tx",
+  "burst_rx",
+  "burst_off",
+  "scatter_rx",
+  "scatter_tx",
+  "reply_gap_off",
+  "reply_tick"
+};
+
+static struct cb_stats stats[ND_PROF_NUM];
+static struct cb_stats dump[ND_PROF_NUM]; // copy printed by the process
+static uint16_t dump_epoch;
+static volatile bool dump_pending = false;
+static uint8_t epochs = 0;
+/*---------------------------------------------------------------------------*/
+PROCESS(nd_prof_process, "ND profiling process");
+/*---------------------------------------------------------------------------*/
+static void
+hist_add(struct hist *h, uint32_t v)
+{
+  uint8_t i = 0;
+  uint32_t x = v;
+
+  while (x > 0 && i < ND_PROF_BUCKETS-1) { // bit length of v
+    x >>= 1;
+    i++;
+  }
+  h->buckets[i]++;
+
+  if (h->count == 0 || v < h->min) {
+    h->min = v;
+  }
+  if (v > h->max) {
+    h->max = v;
+  }
+  h->count++;
+}
+
+static void
+hist_print(uint16_t epoch, const char *name, const char *kind, const struct hist *h)
+{
+  uint8_t i;
+
+  printf("Prof: %u %s %s %u %lu %lu", epoch, name, kind,
+    h->count, (unsigned long)h->min, (unsigned long)h->max);
+  for (i = 0; i < ND_PROF_BUCKETS; i++) {
+    printf(" %u", h->buckets[i]);
+  }
+  printf("\n");
+}
+/*---------------------------------------------------------------------------*/
+void
+nd_prof_init(void)
+{
+#if !defined(ND_PROF_CONF_NOW)
+#if CONTIKI_TARGET_ZOUL
+  (*(volatile uint32_t *)0xE000EDFC) |= (1UL << 24); // DEMCR.TRCENA
+  (*(volatile uint32_t *)0xE0001000) |= 1UL; // DWT_CTRL.CYCCNTENA
+#elif CONTIKI_TARGET_SKY
+  TBCTL = TBSSEL_2 | ID_3 | MC_2 | TBCLR; // SMCLK/8, continuous mode
+#endif
+#endif
+
+  memset(stats, 0, sizeof(stats));
+  epochs = 0;
+  dump_pending = false;
+
+  printf("Prof: clock %lu late %lu\n",
+    (unsigned long)ND_PROF_SECOND, (unsigned long)RTIMER_SECOND);
+
+  process_start(&nd_prof_process, NULL);
+}
+/*---------------------------------------------------------------------------*/
+nd_prof_clock_t
+nd_prof_enter(uint8_t cb, const struct rtimer *t)
+{
+  nd_prof_clock_t start = ND_PROF_NOW();
+
+  if (t != NULL) {
+    rtimer_clock_t now = RTIMER_NOW();
+    if (!RTIMER_CLOCK_LT(now, RTIMER_TIME(t))) { // ignore early firing
+      hist_add(&stats[cb].late, (rtimer_clock_t)(now - RTIMER_TIME(t)));
+    }
+  }
+
+  return start;
+}
+
+void
+nd_prof_exit(uint8_t cb, nd_prof_clock_t start)
+{
+  nd_prof_clock_t dur = ND_PROF_NOW() - start;
+  hist_add(&stats[cb].dur, dur);
+}
+/*---------------------------------------------------------------------------*/
+void
+nd_prof_epoch_end(uint16_t epoch)
+{
+  epochs++;
+  if (epochs < ND_PROF_EPOCHS) {
+    return;
+  }
+  epochs = 0;
+
+  if (dump_pending) { // previous dump still being printed, keep aggregating
+    return;
+  }
+
+  memcpy(dump, stats, sizeof(dump));
+  memset(stats, 0, sizeof(stats));
+  dump_epoch = epoch;
+  dump_pending = true;
+  process_poll(&nd_prof_process);
+}
+/*---------------------------------------------------------------------------*/
+PROCESS_THREAD(nd_prof_process, ev, data)
+{
+  uint8_t i;
+
+  PROCESS_BEGIN();
+
+  while (1) {
+    PROCESS_YIELD_UNTIL(ev == PROCESS_EVENT_POLL);
+
+    for (i = 0; i < ND_PROF_NUM; i++) {
+      if (dump[i].dur.count == 0) {
+        continue;
+      }
+      hist_print(dump_epoch, cb_names[i], "dur", &dump[i].dur);
+      hist_print(dump_epoch, cb_names[i], "late", &dump[i].late);
+    }
+    dump_pending = false;
+  }
+
+  PROCESS_END();
+}
+/*---------------------------------------------------------------------------*/
+#endif /* ND_PROF_ENABLED */
+/*---------------------------------------------------------------------------*/
@@ -0,0 +1,113 @@
+/*---------------------------------------------------------------------------*/
+#ifndef ND_PROF_H_
+#define ND_PROF_H_
+/*---------------------------------------------------------------------------*/
+#include "contiki.h"
+#include "sys/rtimer.h"
+/*---------------------------------------------------------------------------*/
+/* Hot-path instrumentation of the ND callbacks.
+ *
+ * Each callback records how long it ran (entry to exit, in ND_PROF_SECOND
+ * units) and, when fired by the rtimer, how late it started compared to the
+ * scheduled time (in RTIMER_SECOND units). Both are kept as min/max and
+ * log2-bucket histograms and printed every ND_PROF_EPOCHS epochs by a
+ * process, so that no printf happens in interrupt context. The statistics
+ * are global: with several ND instances they aggregate all of them.
+ *
+ * Set ND_PROF_CONF_ENABLED to 1 in project-conf.h to enable it. When
+ * disabled, all the hooks expand to nothing.
+ */
+#ifdef ND_PROF_CONF_ENABLED
+#define ND_PROF_ENABLED ND_PROF_CONF_ENABLED
+#else
+#define ND_PROF_ENABLED 0
+#endif
+
+/* Number of epochs aggregated in each dump */
+#ifdef ND_PROF_CONF_EPOCHS
+#define ND_PROF_EPOCHS ND_PROF_CONF_EPOCHS
+#else
+#define ND_PROF_EPOCHS 10
+#endif
+
+/* Number of histogram buckets: bucket i counts values with bit length i,
+ * i.e. [2^(i-1), 2^i), the last one also collects everything above */
+#ifdef ND_PROF_CONF_BUCKETS
+#define ND_PROF_BUCKETS ND_PROF_CONF_BUCKETS
+#else
+#define ND_PROF_BUCKETS 12
+#endif
+
+/* Timestamp source for callback durations:
+ *  - ND_PROF_CONF_NOW()/ND_PROF_CONF_SECOND if provided by the project
+ *  - zoul: Cortex-M3 DWT cycle counter (32 MHz)
+ *  - sky: msp430 Timer B on SMCLK/8 (~2us resolution, wraps after ~130ms).
+ *    nd_prof_init reprograms Timer B, which the cc2420 driver also uses for
+ *    the SFD capture timestamps: with CC2420_CONF_SFD_TIMESTAMPS set, provide
+ *    ND_PROF_CONF_NOW instead
+ *  - anything else (e.g. native): RTIMER_NOW()
+ */
+#if defined(ND_PROF_CONF_NOW)
+typedef uint32_t nd_prof_clock_t;
+#define ND_PROF_NOW() ND_PROF_CONF_NOW()
+#define ND_PROF_SECOND ND_PROF_CONF_SECOND
+#elif CONTIKI_TARGET_ZOUL
+typedef uint32_t nd_prof_clock_t;
+#define ND_PROF_DWT_CYCCNT (*(volatile uint32_t *)0xE0001004)
+#define ND_PROF_NOW() ND_PROF_DWT_CYCCNT
+#define ND_PROF_SECOND 32000000UL
+#elif CONTIKI_TARGET_SKY
+#if ND_PROF_ENABLED && CC2420_CONF_SFD_TIMESTAMPS
+#error "ND_PROF on sky takes Timer B, used by CC2420_CONF_SFD_TIMESTAMPS: define ND_PROF_CONF_NOW"
+#endif
+typedef uint16_t nd_prof_clock_t;
+#define ND_PROF_NOW() TBR
+#define ND_PROF_SECOND (MSP430_CPU_SPEED / 8)
+#else
+typedef rtimer_clock_t nd_prof_clock_t;
+#define ND_PROF_NOW() RTIMER_NOW()
+#define ND_PROF_SECOND RTIMER_SECOND
+#endif
+/*---------------------------------------------------------------------------*/
+/* Instrumented callbacks */
+enum {
+  ND_PROF_RECV,
+  ND_PROF_BURST_TX,
+  ND_PROF_BURST_RX,
+  ND_PROF_BURST_OFF,
+  ND_PROF_SCATTER_RX,
+  ND_PROF_SCATTER_TX,
+  ND_PROF_REPLY_GAP_OFF,
+  ND_PROF_REPLY_TICK,
+  ND_PROF_NUM
+};
+/*---------------------------------------------------------------------------*/
+#if ND_PROF_ENABLED
+
+void nd_prof_init(void);
+
+/* Called at callback entry. t is the rtimer that fired the callback, or NULL
+ * when the callback was invoked directly (no lateness is recorded then).
+ * Returns the entry timestamp to be passed to nd_prof_exit */
+nd_prof_clock_t nd_prof_enter(uint8_t cb, const struct rtimer *t);
+void nd_prof_exit(uint8_t cb, nd_prof_clock_t start);
+
+/* Called once per epoch, triggers a dump every ND_PROF_EPOCHS epochs */
+void nd_prof_epoch_end(uint16_t epoch);
+
+#define ND_PROF_INIT() nd_prof_init()
+#define ND_PROF_ENTER(cb, t) nd_prof_clock_t nd_prof_start = nd_prof_enter(cb, t)
+#define ND_PROF_EXIT(cb) nd_prof_exit(cb, nd_prof_start)
+#define ND_PROF_EPOCH_END(epoch) nd_prof_epoch_end(epoch)
+
+#else /* ND_PROF_ENABLED */
+
+#define ND_PROF_INIT()
+#define ND_PROF_ENTER(cb, t)
+#define ND_PROF_EXIT(cb)
+#define ND_PROF_EPOCH_END(epoch)
+
+#endif /* ND_PROF_ENABLED */
+/*---------------------------------------------------------------------------*/
+#endif /* ND_PROF_H_ */
+/*---------------------------------------------------------------------------*/
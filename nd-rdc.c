@@ -35,20 +35,73 @@
  * part of the work done for the ANR ARESA2 project.
  */
 /*---------------------------------------------------------------------------*/
+#include "contiki.h"
 #include "net/mac/mac.h"
 #include "net/mac/rdc.h"
 #include "net/netstack.h"
+#include "net/packetbuf.h"
+#include "net/queuebuf.h"
+#include "lib/list.h"
+#include <stdbool.h>
 #include <stdio.h>
 #include "nd.h"
 /*---------------------------------------------------------------------------*/
+/* Outgoing frames are piggybacked on the ND beacons. ND completes them in
+ * the rtimer interrupt, the MAC callbacks are then called by the process */
+struct sent_slot {
+  mac_callback_t sent;
+  void *ptr;
+  int status;
+  int transmissions;
+  volatile bool done;
+  bool used;
+};
+
+static struct sent_slot slots[ND_SEND_QUEUE_LEN];
+/*---------------------------------------------------------------------------*/
+PROCESS(nd_rdc_process, "ND RDC process");
+/*---------------------------------------------------------------------------*/
+static void
+nd_sent(void *ptr, int status, int transmissions)
+{
+  struct sent_slot *slot = ptr;
+
+  slot->status = status;
+  slot->transmissions = transmissions;
+  slot->done = true;
+  process_poll(&nd_rdc_process);
+}
+/*---------------------------------------------------------------------------*/
 static void
 send(mac_callback_t sent, void *ptr)
 {
+  uint8_t i;
+
+  for (i = 0; i < ND_SEND_QUEUE_LEN && slots[i].used; i++);
+
+  if (i == ND_SEND_QUEUE_LEN || packetbuf_totlen() > ND_DATA_MAX_LEN) {
+    mac_call_sent_callback(sent, ptr, MAC_TX_ERR, 0);
+    return;
+  }
+
+  slots[i].sent = sent;
+  slots[i].ptr = ptr;
+  slots[i].done = false;
+  slots[i].used = true;
+  if (!nd_send(packetbuf_hdrptr(), packetbuf_totlen(), nd_sent, &slots[i])) {
+    slots[i].used = false;
+    mac_call_sent_callback(sent, ptr, MAC_TX_ERR, 0);
+  }
 }
 /*---------------------------------------------------------------------------*/
 static void
 send_list(mac_callback_t sent, void *ptr, struct rdc_buf_list *list)
 {
+  while (list != NULL) {
+    queuebuf_to_packetbuf(list->buf);
+    send(sent, ptr);
+    list = list_item_next(list);
+  }
 }
 /*---------------------------------------------------------------------------*/
 static void
@@ -79,6 +132,7 @@ cca(void)
 static void
 init(void)
 {
+  process_start(&nd_rdc_process, NULL);
   on();
 }
 /*---------------------------------------------------------------------------*/
@@ -93,3 +147,25 @@ const struct rdc_driver nd_rdc_driver = {
   cca,
 };
 /*---------------------------------------------------------------------------*/
+PROCESS_THREAD(nd_rdc_process, ev, data)
+{
+  uint8_t i;
+
+  PROCESS_BEGIN();
+
+  while (1) {
+    PROCESS_YIELD_UNTIL(ev == PROCESS_EVENT_POLL);
+
+    for (i = 0; i < ND_SEND_QUEUE_LEN; i++) {
+      if (slots[i].done) {
+        slots[i].done = false;
+        slots[i].used = false;
+        mac_call_sent_callback(slots[i].sent, slots[i].ptr,
+                               slots[i].status, slots[i].transmissions);
+      }
+    }
+  }
+
+  PROCESS_END();
+}
+/*---------------------------------------------------------------------------*/
@@ -9,8 +9,14 @@
 /*---------------------------------------------------------------------------*/
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 /*---------------------------------------------------------------------------*/
 #include "nd.h"
+#include "nd-prof.h"
+/*---------------------------------------------------------------------------*/
+#if RIMESTATS_CONF_ENABLED
+#include "net/rime/rimestats.h"
+#endif
 /*---------------------------------------------------------------------------*/
 #define DEBUG 0
 #if DEBUG
@@ -19,163 +25,1033 @@
 #define PRINTF(...)
 #endif
 /*---------------------------------------------------------------------------*/
-struct nd_callbacks app_cb = {
-  .nd_new_nbr = NULL,
-  .nd_epoch_end = NULL
-  };
+/* Instance behind nd_start / nd_recv */
+static struct nd_instance nd_default;
+
+#define NBR_ACTIVE 0x80 // nbr_state flag, see age_nbrs
+
 /*---------------------------------------------------------------------------*/
+#define NBR_ID_NONE 0xFFFF
 
-struct beacon_msg b = {
-  .node_id = 0
-};
+static uint16_t
+nbr_hash(uint16_t id)
+{
+  return (id ^ (id >> 8)) & (ND_NBR_HASH_SIZE - 1);
+}
 
-static struct rtimer rt;
+/* Index slot of id, or the empty slot where it would be inserted */
+static uint16_t
+nbr_slot(const struct nd_nbr_set *set, uint16_t id)
+{
+  uint16_t h = nbr_hash(id);
+
+  while (set->index[h] != 0 && set->ids[set->index[h] - 1] != id) {
+    h = (h + 1) & (ND_NBR_HASH_SIZE - 1);
+  }
+  return h;
+}
 
-static uint16_t epoch_id = 0;
-static bool ids[MAX_NBR+1] = {false}; // neighbour list to tracks discovery
-static uint8_t epoch_new_nbrs = 0;
-static bool is_reception_window;
+static void
+nbr_set_clear(struct nd_nbr_set *set)
+{
+  set->count = 0;
+  memset(set->index, 0, sizeof(set->index));
+}
 
-void reset_epoch() {
-  PRINTF("ID %u: reset epoch\n", node_id);
-  int i = 0;
-  for (i = 0; i < MAX_NBR+1; i++) {
-    ids[i] = false;
+/* Returns false if the set is full */
+static bool
+nbr_set_add(struct nd_nbr_set *set, uint16_t id)
+{
+  if (set->count >= MAX_NBR) {
+    return false;
   }
+  set->index[nbr_slot(set, id)] = set->count + 1;
+  set->ids[set->count++] = id;
+  return true;
+}
 
-  epoch_new_nbrs = 0;
+/* Rebuild the index after ids has been compacted */
+static void
+nbr_set_reindex(struct nd_nbr_set *set)
+{
+  uint8_t i;
+
+  memset(set->index, 0, sizeof(set->index));
+  for (i = 0; i < set->count; i++) {
+    set->index[nbr_slot(set, set->ids[i])] = i + 1;
+  }
+}
+
+bool
+nd_nbr_set_contains(const struct nd_nbr_set *set, uint16_t id)
+{
+  return set->index[nbr_slot(set, id)] != 0;
+}
+
+uint16_t
+nd_nbr_set_next(const struct nd_nbr_set *set, uint16_t prev)
+{
+  uint8_t pos = 0;
+
+  if (prev != 0) {
+    pos = set->index[nbr_slot(set, prev)]; // position of prev + 1
+    if (pos == 0) {
+      return 0;
+    }
+  }
+  return pos < set->count ? set->ids[pos] : 0;
 }
 
 void
-nd_recv(void)
+nd_nbr_set_diff(struct nd_nbr_set *out,
+                const struct nd_nbr_set *a, const struct nd_nbr_set *b)
+{
+  uint8_t i;
+  uint8_t count = 0;
+
+  for (i = 0; i < a->count; i++) {
+    if (!nd_nbr_set_contains(b, a->ids[i])) {
+      out->ids[count++] = a->ids[i];
+    }
+  }
+  out->count = count;
+  nbr_set_reindex(out);
+}
+/*---------------------------------------------------------------------------*/
+void reset_epoch(struct nd_instance *nd) {
+  PRINTF("ID %u: reset epoch\n", nd->node_id);
+  nbr_set_clear(nd->ids);
+  nd->frame_dirty = true; // load the beacon at least once per epoch
+
+  nd->epoch_new_nbrs = 0;
+  nd->replies_left = ND_REPLY_BUDGET;
+}
+
+const struct nd_rx_stats *
+nd_instance_get_rx_stats(const struct nd_instance *nd)
+{
+  return &nd->last_rx_stats;
+}
+
+const struct nd_rx_stats *
+nd_get_rx_stats(void)
+{
+  return nd_instance_get_rx_stats(&nd_default);
+}
+
+/* ND_CONTINUOUS: update the neighbor set with the neighbors heard in the
+ * epoch that is ending, notifying the application of every change.
+ * ids is turned from the heard set into the active set.
+ * nbr_state[i] is the state of known_nbrs.ids[i]: NBR_ACTIVE | epochs missed
+ * for neighbors in the set, consecutive epochs heard for the others.
+ * Neighbors are not aged during a transition epoch: the schedule changed and
+ * may not overlap the neighbors' one as it used to */
+static void age_nbrs(struct nd_instance *nd)
+{
+  struct nd_nbr_set *known = &nd->known_nbrs;
+  uint8_t i;
+  uint8_t kept = 0;
+
+  // start tracking the neighbors heard for the first time
+  for (i = 0; i < nd->ids->count; i++) {
+    if (known->count < MAX_NBR &&
+        !nd_nbr_set_contains(known, nd->ids->ids[i])) {
+      nd->nbr_state[known->count] = 0;
+      nbr_set_add(known, nd->ids->ids[i]);
+    }
+  }
+
+  for (i = 0; i < known->count; i++) {
+    uint16_t id = known->ids[i];
+    uint8_t st = nd->nbr_state[i];
+
+    if (nd_nbr_set_contains(nd->ids, id)) {
+      if (st & NBR_ACTIVE) {
+        st = NBR_ACTIVE;
+      } else if (++st >= ND_JOIN_EPOCHS) {
+        st = NBR_ACTIVE;
+        nd->active_nbrs++;
+        if (nd->cb.nd_nbr_joined != NULL) {
+          nd->cb.nd_nbr_joined(nd, nd->epoch_id, id);
+        }
+      }
+    } else if (st & NBR_ACTIVE) {
+      if (nd->is_transition_epoch) {
+        // keep as is
+      } else if (++st - NBR_ACTIVE >= ND_AGING_EPOCHS) {
+        st = 0;
+        nd->active_nbrs--;
+        if (nd->cb.nd_nbr_lost != NULL) {
+          nd->cb.nd_nbr_lost(nd, nd->epoch_id, id);
+        }
+      }
+    } else {
+      st = 0; // hits must be consecutive
+    }
+
+    if (st != 0) { // compact in place, forgetting the neighbors with no state
+      known->ids[kept] = id;
+      nd->nbr_state[kept] = st;
+      kept++;
+    }
+  }
+  known->count = kept;
+  nbr_set_reindex(known);
+
+  nbr_set_clear(nd->ids);
+  for (i = 0; i < known->count; i++) {
+    if (nd->nbr_state[i] & NBR_ACTIVE) {
+      nbr_set_add(nd->ids, known->ids[i]);
+    }
+  }
+}
+
+static bool nbr_is_active(const struct nd_instance *nd, uint16_t id)
+{
+  uint8_t pos = nd->known_nbrs.index[nbr_slot(&nd->known_nbrs, id)];
+  return pos != 0 && (nd->nbr_state[pos - 1] & NBR_ACTIVE);
+}
+
+/* At least pct percent of the frames of the epoch that is ending were
+ * corrupted or collided */
+static bool is_lossy(const struct nd_instance *nd, uint8_t pct)
+{
+  const struct nd_rx_stats *st = &nd->last_rx_stats;
+  uint32_t bad = (uint32_t)st->bad_len + st->badcrc + nd->tx_collisions;
+
+  return bad * 100 >= (uint32_t)pct * (st->rx + nd->tx_collisions + 1);
+}
+
+/* ND_ADAPTIVE: vote for the primitive that fits the epoch that is ending */
+static void adapt_mode(struct nd_instance *nd, uint8_t num_nbr)
+{
+  uint8_t mode = nd->mode & ND_MODE_MASK;
+  uint8_t want = mode;
+  bool lossy = is_lossy(nd, ND_ADAPTIVE_LOSS);
+
+  if (mode == ND_BURST && (num_nbr >= ND_ADAPTIVE_DENSE || lossy)) {
+    want = ND_SCATTER;
+  } else if (mode == ND_SCATTER && num_nbr <= ND_ADAPTIVE_SPARSE && !lossy) {
+    want = ND_BURST;
+  }
+
+  if (want == mode) {
+    nd->adapt_epochs = 0;
+  } else if (++nd->adapt_epochs >= ND_ADAPTIVE_EPOCHS) {
+    nd->adapt_epochs = 0;
+    nd->next_mode = want;
+  }
+}
+
+/* Read the TX power range of the radio. A radio that does not report it
+ * keeps its power */
+static void txpower_init(struct nd_instance *nd)
+{
+  nd->txpower = 0;
+  if (nd->radio->get_value(RADIO_PARAM_TXPOWER, &nd->txpower) != RADIO_RESULT_OK ||
+      nd->radio->get_value(RADIO_CONST_TXPOWER_MIN, &nd->txpower_min) != RADIO_RESULT_OK ||
+      nd->radio->get_value(RADIO_CONST_TXPOWER_MAX, &nd->txpower_max) != RADIO_RESULT_OK) {
+    nd->txpower_min = nd->txpower;
+    nd->txpower_max = nd->txpower;
+  }
+}
+
+/* ND_TXPOWER: step the power for the next epoch. txpower keeps the requested
+ * value, the radio may round it to one of its levels */
+static void txpower_adjust(struct nd_instance *nd, uint8_t num_nbr)
+{
+  radio_value_t p = nd->txpower;
+
+  if (num_nbr > ND_TXPOWER_HIGH || is_lossy(nd, ND_TXPOWER_LOSS)) {
+    p -= ND_TXPOWER_STEP;
+  } else if (num_nbr < ND_TXPOWER_TARGET) {
+    p += ND_TXPOWER_STEP;
+  }
+  if (p < nd->txpower_min) {
+    p = nd->txpower_min;
+  } else if (p > nd->txpower_max) {
+    p = nd->txpower_max;
+  }
+
+  if (p != nd->txpower &&
+      nd->radio->set_value(RADIO_PARAM_TXPOWER, p) == RADIO_RESULT_OK) {
+    PRINTF("txpower %d\n", p);
+    nd->txpower = p;
+  }
+}
+
+/* Enter a bootstrap stage, unless already in a more boosted one */
+static void boot_enter(struct nd_instance *nd, uint8_t stage)
+{
+  if (stage > nd->boot_stage) {
+    nd->boot_stage = stage;
+    nd->boot_epochs = ND_BOOT_STAGE_EPOCHS;
+  }
+}
+
+/* Re-enter a short bootstrap on a sudden loss of neighbors. The average
+ * only covers the steady state, boosted epochs find more neighbors */
+static void boot_check(struct nd_instance *nd, uint8_t num_nbr)
+{
+  uint16_t n = (uint16_t)num_nbr << 4;
+
+  if (ND_BOOT_STAGES == 0) { // bootstrap disabled
+    return;
+  }
+  if (nd->boot_stage > 0 || nd->avg_nbrs == 0) {
+    nd->avg_nbrs = nd->boot_stage > 0 ? 0 : n;
+    return;
+  }
+
+  if (nd->avg_nbrs >= (2 << 4) &&
+      (uint32_t)n * 100 <= (uint32_t)nd->avg_nbrs * (100 - ND_BOOT_LOSS_PCT)) {
+    PRINTF("neighbor loss, bootstrap\n");
+    nd->avg_nbrs = 0;
+    boot_enter(nd, 1);
+    return;
+  }
+  nd->avg_nbrs = nd->avg_nbrs - (nd->avg_nbrs >> 2) + (n >> 2);
+}
+
+/* Compute the schedule of the epoch about to start */
+static void update_schedule(struct nd_instance *nd)
+{
+  struct nd_schedule *sched = &nd->sched;
+
+  if (nd->boot_stage > 0 && nd->boot_epochs-- == 0) {
+    nd->boot_stage--;
+    nd->boot_epochs = ND_BOOT_STAGE_EPOCHS - 1;
+  }
+  sched->boost = 1 << nd->boot_stage;
+
+  if (sched->boost == 1) {
+    sched->burst_t_delay = BURST_T_DELAY;
+    sched->burst_num_txs = BURST_NUM_TXS;
+    sched->burst_x_dur = BURST_X_DUR;
+    sched->scatter_t_slot = SCATTER_T_SLOT;
+    sched->scatter_x_slot = SCATTER_X_SLOT;
+    sched->scatter_num_txs = SCATTER_NUM_TXS;
+    return;
+  }
+
+  sched->burst_t_delay = BURST_T_DELAY / sched->boost;
+  sched->burst_num_txs = BURST_NUM_TXS * sched->boost;
+  sched->burst_x_dur = BURST_X_DUR * sched->boost;
+
+  sched->scatter_t_slot = SCATTER_T_SLOT * sched->boost;
+  if (sched->scatter_t_slot > EPOCH_INTERVAL_RT / 2) {
+    sched->scatter_t_slot = EPOCH_INTERVAL_RT / 2;
+  }
+  sched->scatter_num_txs = SCATTER_NUM_TXS * sched->boost;
+  sched->scatter_x_slot = (EPOCH_INTERVAL_RT - sched->scatter_t_slot) / sched->scatter_num_txs;
+}
+
+/* Count the epoch for the payload being carried and complete it after
+ * ND_DATA_EPOCHS of them. The next head is carried from the next epoch on */
+static void data_epoch_end(struct nd_instance *nd, uint8_t num_nbr)
+{
+  struct nd_send_entry *e;
+  int status;
+
+  if (nd->queue_head == nd->queue_tail) {
+    return;
+  }
+  e = &nd->queue[nd->queue_head % ND_SEND_QUEUE_LEN];
+  if (e->started) {
+    e->epochs++;
+    if (num_nbr > e->nbrs) {
+      e->nbrs = num_nbr;
+    }
+    if (e->epochs < ND_DATA_EPOCHS) {
+      return;
+    }
+
+    if (e->txs > 0 && e->collisions == e->txs) {
+      status = MAC_TX_COLLISION;
+    } else if (e->nbrs == 0) {
+      status = MAC_TX_NOACK;
+    } else {
+      status = MAC_TX_OK;
+    }
+    nd->queue_head++;
+    if (e->sent != NULL) {
+      e->sent(e->ptr, status, e->txs);
+    }
+    if (nd->queue_head == nd->queue_tail) {
+      return;
+    }
+    e = &nd->queue[nd->queue_head % ND_SEND_QUEUE_LEN];
+  }
+  e->started = true;
+}
+
+static void epoch_end(struct nd_instance *nd)
+{
+  uint8_t num_nbr;
+
+  nd->last_rx_stats = nd->rx_stats;
+#if RIMESTATS_CONF_ENABLED
+  nd->last_rx_stats.badcrc = rimestats.badcrc - nd->last_badcrc;
+  nd->last_badcrc = rimestats.badcrc;
+#endif
+  memset(&nd->rx_stats, 0, sizeof(nd->rx_stats));
+
+  if (nd->mode & ND_CONTINUOUS) {
+    age_nbrs(nd);
+    num_nbr = nd->active_nbrs;
+  } else {
+    num_nbr = nd->epoch_new_nbrs;
+  }
+  bool switching = nd->is_transition_epoch;
+  nd->is_transition_epoch = false;
+  nd->cb.nd_epoch_end(nd, nd->epoch_id, num_nbr);
+
+  // publish the set, the next epoch fills the other buffer
+  struct nd_nbr_set *tmp = nd->last_ids;
+  nd->last_ids = nd->ids;
+  nd->ids = tmp;
+  if (nd->cb.nd_epoch_nbrs != NULL) {
+    nd->cb.nd_epoch_nbrs(nd, nd->epoch_id, nd->last_ids);
+  }
+
+  // boosted epochs find more neighbors than the steady state would
+  if ((nd->mode & ND_ADAPTIVE) && nd->boot_stage == 0) {
+    adapt_mode(nd, num_nbr);
+  }
+  if ((nd->mode & ND_TXPOWER) && nd->boot_stage == 0) {
+    txpower_adjust(nd, num_nbr);
+  }
+  // a switch of primitive is no loss of neighbors
+  switching = switching || nd->next_mode != (nd->mode & ND_MODE_MASK);
+  if (!switching) {
+    boot_check(nd, num_nbr);
+  }
+  data_epoch_end(nd, num_nbr);
+  nd->tx_collisions = 0;
+  ND_PROF_EPOCH_END(nd->epoch_id);
+  nd->epoch_id++;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Payload carried by the beacons of this epoch, NULL if none */
+static struct nd_send_entry *data_head(struct nd_instance *nd)
+{
+  struct nd_send_entry *e = &nd->queue[nd->queue_head % ND_SEND_QUEUE_LEN];
+
+  if (nd->queue_head == nd->queue_tail || !e->started) {
+    return NULL;
+  }
+  return e;
+}
+
+/* Build the next beacon, carrying the head of the send queue if any */
+static void beacon_build(struct nd_instance *nd)
+{
+  struct beacon_msg b = {
+    .node_id = nd->node_id,
+    .flags = 0
+  };
+  const struct nd_send_entry *e = data_head(nd);
+
+  nd->frame_len = sizeof(b);
+  if (e != NULL) {
+    b.flags |= ND_BEACON_DATA;
+    nd->frame[sizeof(b)] = e->seq;
+    memcpy(&nd->frame[ND_DATA_HDR_LEN], e->data, e->len);
+    nd->frame_len = ND_DATA_HDR_LEN + e->len;
+  }
+  memcpy(nd->frame, &b, sizeof(b));
+}
+
+/* The beacon in the TX FIFO is not the next one to be sent: the carried
+ * payload changed since it was built */
+static bool beacon_is_stale(struct nd_instance *nd)
+{
+  const struct nd_send_entry *e = data_head(nd);
+
+  if (!ND_TX_REUSE_FIFO || nd->frame_dirty) {
+    return true;
+  }
+  if (e == NULL) {
+    return nd->frame_len != sizeof(struct beacon_msg);
+  }
+  return nd->frame_len == sizeof(struct beacon_msg) ||
+    nd->frame[sizeof(struct beacon_msg)] != e->seq;
+}
+
+/* Send a beacon, loading it into the TX FIFO only if needed */
+static int beacon_send(struct nd_instance *nd)
+{
+  int ret;
+  bool prepared = false;
+
+  if (beacon_is_stale(nd)) {
+    beacon_build(nd);
+    if (nd->radio->prepare(nd->frame, nd->frame_len) != 0) {
+      nd->frame_dirty = true;
+      return RADIO_TX_ERR;
+    }
+    nd->frame_dirty = false;
+    prepared = true;
+  }
+
+  ret = nd->radio->transmit(nd->frame_len);
+  if (ret == RADIO_TX_ERR && !prepared) {
+    // the radio may have dropped the frame, load it again
+    PRINTF("tx error, prepare again\n");
+    if (nd->radio->prepare(nd->frame, nd->frame_len) == 0) {
+      ret = nd->radio->transmit(nd->frame_len);
+    }
+  }
+  if (ret == RADIO_TX_ERR) {
+    nd->frame_dirty = true;
+  }
+
+  if (ret == RADIO_TX_COLLISION) {
+    nd->tx_collisions++;
+  }
+
+  if (nd->frame_len > sizeof(struct beacon_msg)) {
+    struct nd_send_entry *e = &nd->queue[nd->queue_head % ND_SEND_QUEUE_LEN];
+
+    e->txs++;
+    if (ret != RADIO_TX_OK) {
+      e->collisions++;
+    }
+  }
+  return ret;
+}
+
+bool
+nd_instance_send(struct nd_instance *nd, const void *data, uint8_t len,
+                 nd_sent_callback_t sent, void *ptr)
+{
+  struct nd_send_entry *e;
+
+  if (len == 0 || len > ND_DATA_MAX_LEN ||
+      (uint8_t)(nd->queue_tail - nd->queue_head) >= ND_SEND_QUEUE_LEN) {
+    return false;
+  }
+
+  e = &nd->queue[nd->queue_tail % ND_SEND_QUEUE_LEN];
+  e->sent = sent;
+  e->ptr = ptr;
+  e->seq = nd->data_seq++;
+  e->len = len;
+  e->started = false;
+  e->epochs = 0;
+  e->nbrs = 0;
+  e->txs = 0;
+  e->collisions = 0;
+  memcpy(e->data, data, len);
+  nd->queue_tail++; // hand the entry over to the rtimer callbacks
+  return true;
+}
+
+bool
+nd_send(const void *data, uint8_t len, nd_sent_callback_t sent, void *ptr)
+{
+  return nd_instance_send(&nd_default, data, len, sent, ptr);
+}
+
+/* Remember a received payload, returns false if already handed up */
+static bool data_is_new(struct nd_instance *nd, uint16_t id, uint8_t seq)
+{
+  uint8_t i;
+
+  for (i = 0; i < ND_DATA_SEEN; i++) {
+    if (nd->data_seen[i].id == id && nd->data_seen[i].seq == seq) {
+      return false;
+    }
+  }
+  nd->data_seen[nd->data_seen_next].id = id;
+  nd->data_seen[nd->data_seen_next].seq = seq;
+  nd->data_seen_next = (nd->data_seen_next + 1) % ND_DATA_SEEN;
+  return true;
+}
+/*---------------------------------------------------------------------------*/
+/* Arm the rtimer. A time already passed (e.g. application callbacks
+ * running late in epoch_end) is moved to just after now: on msp430 the
+ * rtimer would otherwise only fire after the counter wraps, 2 s later */
+#define TIMER_GUARD US_TO_RTIMERTICKS(250)
+
+static void set_timer(struct nd_instance *nd, rtimer_clock_t time, rtimer_callback_t cb)
+{
+  rtimer_clock_t min = RTIMER_NOW() + (unsigned)TIMER_GUARD;
+
+  if (RTIMER_CLOCK_LT(time, min)) {
+    PRINTF("late timer, %u ticks\n", (unsigned)(rtimer_clock_t)(min - time));
+    time = min;
+  }
+  rtimer_set(&nd->rt, time, 1, cb, nd);
+}
+
+/* ND_REACTIVE: answer a beacon right away, so that its sender discovers us
+ * in its listen gap. nd_recv runs in process context and only flags the
+ * reply: the rtimer may not be re-armed from there, since Contiki programs
+ * the timer hardware only for the first pending rtimer. Reception windows
+ * are instead stepped in short random ticks, and the tick sends the
+ * pending reply. The ticks also act as jitter between repliers */
+static rtimer_clock_t reply_tick_len(void)
+{
+  return US_TO_RTIMERTICKS(ND_REPLY_JITTER_US / 2 +
+                           random_rand() % (ND_REPLY_JITTER_US / 2 + 1));
+}
+
+/* Close the reception window with cb at end, stepping it with reply_tick
+ * in ND_REACTIVE mode */
+static void window_timer(struct nd_instance *nd, rtimer_clock_t end, rtimer_callback_t cb)
+{
+  rtimer_clock_t tick = end;
+
+  if (nd->mode & ND_REACTIVE) {
+    tick = RTIMER_NOW() + reply_tick_len();
+  }
+  if (!RTIMER_CLOCK_LT(tick, end)) {
+    set_timer(nd, end, cb);
+    return;
+  }
+  nd->win_end = end;
+  nd->win_cb = cb;
+  set_timer(nd, tick, reply_tick);
+}
+
+void reply_tick(struct rtimer *t, void *ptr)
+{
+  ND_PROF_ENTER(ND_PROF_REPLY_TICK, t);
+  struct nd_instance *nd = ptr;
+  struct beacon_msg reply = {
+    .node_id = nd->node_id,
+    .flags = ND_BEACON_REPLY
+  };
+
+  if (nd->reply_pending) {
+    nd->reply_pending = false;
+    if (nd->is_reception_window && nd->replies_left > 0) {
+      nd->frame_dirty = true; // the reply takes the TX FIFO
+      if (nd->radio->send(&reply, sizeof(reply)) == RADIO_TX_COLLISION) {
+        nd->tx_collisions++;
+      }
+      nd->replies_left--;
+      nd->rx_stats.replied++;
+    }
+  }
+
+  window_timer(nd, nd->win_end, nd->win_cb);
+
+  ND_PROF_EXIT(ND_PROF_REPLY_TICK);
+}
+
+uint8_t
+nd_instance_input(struct nd_instance *nd, const void *data, uint16_t len)
 {
   /* New packet received
-   * 1. Read packet from packetbuf---packetbuf_dataptr()
+   * 1. Read packet from data
    * 2. If a new neighbor is discovered within the epoch, notify the application
    * NOTE: The testbed's firefly nodes can receive packets only if they are at 
    * least 3 bytes long (5 considering the CRC). 
    * If while you are testing you receive nothing make sure your packet is long enough
    */
+  ND_PROF_ENTER(ND_PROF_RECV, NULL);
+
   // PRINTF("recv\n");
-  if (!is_reception_window) { // limit packet elaboration to rx windows only
+  nd->rx_stats.rx++;
+  if (!nd->is_reception_window) { // limit packet elaboration to rx windows only
     PRINTF("not reception window\n");
-    packetbuf_clear();
-    return;
-  }
-  if (packetbuf_datalen() != sizeof(struct beacon_msg)) {
-    PRINTF("unexpected length: %d\n", packetbuf_datalen());
-    packetbuf_clear();
-    return;
+    nd->rx_stats.not_window++;
+    ND_PROF_EXIT(ND_PROF_RECV);
+    return 0;
   }
 
   struct beacon_msg recv;
-  memcpy(&recv, packetbuf_dataptr(), sizeof(recv));
-  packetbuf_clear();
+  bool has_data = false;
+
+  if (len >= sizeof(recv)) {
+    memcpy(&recv, data, sizeof(recv));
+    has_data = (recv.flags & ND_BEACON_DATA) != 0;
+  }
+  if (len < sizeof(recv) ||
+      (has_data ? len <= ND_DATA_HDR_LEN : len != sizeof(recv))) {
+    PRINTF("unexpected length: %d\n", len);
+    nd->rx_stats.bad_len++;
+    ND_PROF_EXIT(ND_PROF_RECV);
+    return 0;
+  }
 
   uint16_t recv_nid = recv.node_id;
 
-  if (recv_nid < 1 || recv_nid > MAX_NBR || recv_nid == node_id) { // 1..MAX_NBR
-    PRINTF("unexpected node_id: %d\n", recv_nid);
-    return;
+  if (recv_nid == 0 || recv_nid == NBR_ID_NONE || recv_nid == nd->node_id) {
+    PRINTF("unexpected node_id: %u\n", recv_nid);
+    if (recv_nid == nd->node_id) {
+      nd->rx_stats.self_id++;
+    } else {
+      nd->rx_stats.bad_id++;
+    }
+    ND_PROF_EXIT(ND_PROF_RECV);
+    return 0;
   }
 
   PRINTF("recv.node_id: %u\n", recv_nid);
 
-  if (!ids[recv_nid]) {
+  if (!nd_nbr_set_contains(nd->ids, recv_nid)) {
     // new neighbour, not seen yet
+    if (!nbr_set_add(nd->ids, recv_nid)) {
+      PRINTF("neighbor set full, dropping %u\n", recv_nid);
+      nd->rx_stats.bad_id++;
+      ND_PROF_EXIT(ND_PROF_RECV);
+      return 0;
+    }
     PRINTF("ids[%u] is now true\n", recv_nid);
-    ids[recv_nid] = true;
-    app_cb.nd_new_nbr(epoch_id, recv_nid);
-    epoch_new_nbrs++;
+    if (!(nd->mode & ND_CONTINUOUS)) {
+      nd->cb.nd_new_nbr(nd, nd->epoch_id, recv_nid);
+    }
+    nd->epoch_new_nbrs++;
+
+    if ((nd->mode & ND_REACTIVE) && !(recv.flags & ND_BEACON_REPLY) &&
+        nd->replies_left > 0 &&
+        !((nd->mode & ND_CONTINUOUS) && nbr_is_active(nd, recv_nid))) {
+      nd->reply_pending = true;
+    }
+  } else {
+    nd->rx_stats.dup++;
+  }
+
+  // beacons are repeated, the payload is handed up only once
+  if (has_data && data_is_new(nd, recv_nid, ((const uint8_t *)data)[sizeof(recv)])) {
+    nd->rx_stats.data++;
+    ND_PROF_EXIT(ND_PROF_RECV);
+    return ND_DATA_HDR_LEN;
+  }
+
+  ND_PROF_EXIT(ND_PROF_RECV);
+  return 0;
+}
+
+void
+nd_recv(void)
+{
+  uint8_t hdr_len = nd_instance_input(&nd_default, packetbuf_dataptr(), packetbuf_datalen());
+
+  if (hdr_len > 0) {
+    // hand the payload up, with the sender node id as link address
+    struct beacon_msg recv;
+    linkaddr_t addr;
+
+    memcpy(&recv, packetbuf_dataptr(), sizeof(recv));
+    linkaddr_copy(&addr, &linkaddr_null);
+    addr.u8[0] = recv.node_id & 0xFF;
+    addr.u8[1] = recv.node_id >> 8;
+    packetbuf_set_addr(PACKETBUF_ADDR_SENDER, &addr);
+    packetbuf_hdrreduce(hdr_len);
+    NETSTACK_MAC.input();
   }
+  packetbuf_clear();
+}
+
+void
+nd_instance_data_input(struct nd_instance *nd, uint16_t src,
+                       const void *data, uint8_t len)
+{
+  if (nd->cb.nd_data != NULL) {
+    nd->cb.nd_data(nd, nd->epoch_id, src, data, len);
+  }
+}
+
+void
+nd_data_input(void)
+{
+  const linkaddr_t *addr = packetbuf_addr(PACKETBUF_ADDR_SENDER);
+
+  nd_instance_data_input(&nd_default, addr->u8[0] | (addr->u8[1] << 8),
+                         packetbuf_dataptr(), packetbuf_datalen());
 }
 /*---------------------------------------------------------------------------*/
+/* Schedule the first callback of the next epoch, switching primitive if
+ * requested. Both primitives have the same epoch length, so the switch
+ * does not move the epoch boundaries */
+static void next_epoch(struct nd_instance *nd, rtimer_clock_t time)
+{
+  if (nd->next_mode != (nd->mode & ND_MODE_MASK)) {
+    PRINTF("switch to %s\n", nd->next_mode == ND_BURST ? "ND_BURST" : "ND_SCATTER");
+    nd->mode = (nd->mode & ~ND_MODE_MASK) | nd->next_mode;
+    nd->is_transition_epoch = true;
+  }
+  update_schedule(nd);
+
+  if ((nd->mode & ND_MODE_MASK) == ND_BURST) {
+    set_timer(nd, time, burst_tx);
+  } else {
+    set_timer(nd, time, scatter_rx);
+  }
+}
+
 void
-nd_start(uint8_t mode, const struct nd_callbacks *cb)
+nd_instance_set_mode(struct nd_instance *nd, uint8_t mode)
+{
+  mode &= ND_MODE_MASK;
+  if (mode == ND_BURST || mode == ND_SCATTER) {
+    nd->next_mode = mode;
+  }
+}
+
+uint8_t
+nd_instance_get_mode(const struct nd_instance *nd)
+{
+  return nd->mode & ND_MODE_MASK;
+}
+
+radio_value_t
+nd_instance_get_txpower(const struct nd_instance *nd)
+{
+  return nd->txpower;
+}
+
+void
+nd_set_mode(uint8_t mode)
+{
+  nd_instance_set_mode(&nd_default, mode);
+}
+
+uint8_t
+nd_get_mode(void)
+{
+  return nd_instance_get_mode(&nd_default);
+}
+
+radio_value_t
+nd_get_txpower(void)
+{
+  return nd_instance_get_txpower(&nd_default);
+}
+/*---------------------------------------------------------------------------*/
+void
+nd_instance_init(struct nd_instance *nd, uint16_t node_id,
+                 const struct radio_driver *radio)
+{
+  memset(nd, 0, sizeof(*nd));
+  nd->node_id = node_id;
+  nd->radio = radio;
+}
+
+void
+nd_instance_start(struct nd_instance *nd, uint8_t mode,
+                  const struct nd_callbacks *cb)
 { 
-  app_cb.nd_epoch_end = cb->nd_epoch_end;
-  app_cb.nd_new_nbr = cb->nd_new_nbr;
+  nd->cb = *cb;
+  nd->mode = mode;
+  nd->next_mode = mode & ND_MODE_MASK;
+  nd->is_transition_epoch = false;
+  nd->is_reception_window = false;
+  nd->is_burst_phase = false;
+  nd->burst_rx_count = 0;
+  nd->epoch_id = 0;
+  nd->adapt_epochs = 0;
+  nd->tx_collisions = 0;
+  nd->avg_nbrs = 0;
+  nd->boot_stage = 0;
+  boot_enter(nd, ND_BOOT_STAGES);
+  update_schedule(nd);
+  txpower_init(nd);
+
+  nd->frame_dirty = true;
+  nd->data_seq = random_rand();
+  memset(nd->data_seen, 0, sizeof(nd->data_seen));
+
+  nd->ids = &nd->nbr_sets[0];
+  nd->last_ids = &nd->nbr_sets[1];
+  nbr_set_clear(nd->ids);
+  nbr_set_clear(nd->last_ids);
+  reset_epoch(nd);
+  nbr_set_clear(&nd->known_nbrs);
+  nd->active_nbrs = 0;
+  memset(&nd->rx_stats, 0, sizeof(nd->rx_stats));
+  memset(&nd->last_rx_stats, 0, sizeof(nd->last_rx_stats));
+#if RIMESTATS_CONF_ENABLED
+  nd->last_badcrc = rimestats.badcrc;
+#endif
 
-  reset_epoch();
+  ND_PROF_INIT();
+
+  /* First callbacks are invoked directly, not by the rtimer (t is NULL) */
+  if (mode & ND_CONTINUOUS) {
+    printf("ND_CONTINUOUS\n");
+  }
+  if (mode & ND_ADAPTIVE) {
+    printf("ND_ADAPTIVE\n");
+  }
+  if (mode & ND_REACTIVE) {
+    printf("ND_REACTIVE\n");
+  }
+  if (mode & ND_TXPOWER) {
+    printf("ND_TXPOWER\n");
+  }
 
-  if (mode == ND_BURST) {
+  if ((mode & ND_MODE_MASK) == ND_BURST) {
     printf("ND_BURST\n");
-    burst_tx(&rt, NULL);
-  } else if (mode == ND_SCATTER) {
+    burst_tx(NULL, nd);
+  } else if ((mode & ND_MODE_MASK) == ND_SCATTER) {
     printf("ND_SCATTER\n");
-    scatter_rx(&rt, NULL);
+    scatter_rx(NULL, nd);
   } else {
     printf("error: invalid mode\n");
   }
 }
+
+void
+nd_start(uint8_t mode, const struct nd_callbacks *cb)
+{
+  // nd_default is static, no need to clear it (nor its send queue)
+  nd_default.node_id = node_id;
+  nd_default.radio = &NETSTACK_RADIO;
+  nd_instance_start(&nd_default, mode, cb);
+}
 /*---------------------------------------------------------------------------*/
+// ND_REACTIVE listen gap after each beacon
+
+/* Go on with the schedule after a beacon: call cb at time, or end the epoch
+ * and start the next one at time if cb is NULL. In ND_REACTIVE mode the
+ * radio first listens for replies for ND_REPLY_GAP_US */
+static void after_beacon(struct nd_instance *nd, rtimer_clock_t time, rtimer_callback_t cb)
+{
+  rtimer_clock_t gap_end = RTIMER_NOW() + (unsigned)US_TO_RTIMERTICKS(ND_REPLY_GAP_US);
+
+  // no room for the gap before the next callback (e.g. boosted bursts)
+  if (!(nd->mode & ND_REACTIVE) || !RTIMER_CLOCK_LT(gap_end, time)) {
+    if (cb != NULL) {
+      set_timer(nd, time, cb);
+    } else {
+      epoch_end(nd);
+      next_epoch(nd, time);
+    }
+    return;
+  }
+
+  nd->gap_next_time = time;
+  nd->gap_next_cb = cb;
+
+  nd->reply_pending = false;
+  nd->is_extended = false;
+  nd->is_reception_window = true;
+  nd->radio->on();
+
+  window_timer(nd, gap_end, reply_gap_off);
+}
+
+void reply_gap_off(struct rtimer *t, void *ptr)
+{
+  ND_PROF_ENTER(ND_PROF_REPLY_GAP_OFF, t);
+  struct nd_instance *nd = ptr;
+  rtimer_clock_t ext = RTIMER_NOW() + (unsigned)US_TO_RTIMERTICKS(500);
+
+  // keep listening for a reply being received, unless it delays the schedule
+  if (nd->radio->receiving_packet() && RTIMER_CLOCK_LT(ext, nd->gap_next_time)) {
+    if (!nd->is_extended) {
+      nd->is_extended = true;
+      nd->rx_stats.extended++;
+    }
+    set_timer(nd, ext, reply_gap_off);
+    ND_PROF_EXIT(ND_PROF_REPLY_GAP_OFF);
+    return;
+  }
+
+  nd->is_reception_window = false;
+  nd->radio->off();
+
+  if (nd->gap_next_cb != NULL) {
+    set_timer(nd, nd->gap_next_time, nd->gap_next_cb);
+  } else {
+    epoch_end(nd);
+    next_epoch(nd, nd->gap_next_time);
+  }
 
-static uint8_t burst_tx_count = 0;
-static uint8_t burst_rx_count = 0;
+  ND_PROF_EXIT(ND_PROF_REPLY_GAP_OFF);
+}
+/*---------------------------------------------------------------------------*/
 
 void burst_tx(struct rtimer *t, void *ptr)
 {
-  is_reception_window = false;
+  ND_PROF_ENTER(ND_PROF_BURST_TX, t);
+  struct nd_instance *nd = ptr;
+
+  nd->is_reception_window = false;
 
-  if (!(bool)ptr) { // ptr is null or false if it's a new epoch transmission and not a burst phase
-    burst_tx_count = 0; // reset tx counter 
+  if (!nd->is_burst_phase) { // new epoch transmission, not a burst phase one
+    nd->is_burst_phase = true;
+    nd->burst_tx_count = 0; // reset tx counter 
 
     // reset discovered neighbours at new epoch
-    reset_epoch();
+    reset_epoch(nd);
   }
 
-  if (burst_tx_count < BURST_NUM_TXS) {
-    b.node_id = node_id;
-    NETSTACK_RADIO.send(&b, sizeof(b));
-    burst_tx_count++;
+  if (nd->burst_tx_count < nd->sched.burst_num_txs) {
+    beacon_send(nd);
+    nd->burst_tx_count++;
 
-    void* p;
-    bool f = true;
-    p = &f; // avoid compiler warning
-    unsigned short random_us = random_rand() % (3 * 1000); // up to 3 milliseconds
-    rtimer_set(&rt, RTIMER_NOW() + BURST_T_DELAY - (unsigned)US_TO_RTIMERTICKS(random_us), 1, burst_tx, p);
+    unsigned short random_us = random_rand() % (3 * 1000 / nd->sched.boost); // up to 3 milliseconds
+    after_beacon(nd, RTIMER_NOW() + nd->sched.burst_t_delay - (unsigned)US_TO_RTIMERTICKS(random_us), burst_tx);
   } else {
-    burst_rx(&rt, NULL);
+    nd->is_burst_phase = false;
+    burst_rx(NULL, nd);
   }
+
+  ND_PROF_EXIT(ND_PROF_BURST_TX);
 }
 
 void burst_rx(struct rtimer *t, void *ptr)
 {
-  is_reception_window = true;
-  NETSTACK_RADIO.on();
+  ND_PROF_ENTER(ND_PROF_BURST_RX, t);
+  struct nd_instance *nd = ptr;
+
+  nd->reply_pending = false;
+  nd->is_extended = false;
+  nd->is_reception_window = true;
+  nd->radio->on();
   
-  rtimer_set(&rt, RTIMER_NOW() + BURST_X_DUR, 1, burst_off, NULL);
+  window_timer(nd, RTIMER_NOW() + nd->sched.burst_x_dur, burst_off);
+
+  ND_PROF_EXIT(ND_PROF_BURST_RX);
 }
 
 void burst_off(struct rtimer *t, void *ptr)
 {
-  if (NETSTACK_RADIO.receiving_packet()) {
+  ND_PROF_ENTER(ND_PROF_BURST_OFF, t);
+  struct nd_instance *nd = ptr;
+
+  if (nd->radio->receiving_packet()) {
     PRINTF("receiving packet\n");
+    if (!nd->is_extended) {
+      nd->is_extended = true;
+      nd->rx_stats.extended++;
+    }
     // packetbuf_clear();
-    rtimer_set(&rt, RTIMER_NOW() + (unsigned)US_TO_RTIMERTICKS(500), 1, burst_off, NULL);
+    set_timer(nd, RTIMER_NOW() + (unsigned)US_TO_RTIMERTICKS(500), burst_off);
+    ND_PROF_EXIT(ND_PROF_BURST_OFF);
     return;
   }
 
-  is_reception_window = false;
-  NETSTACK_RADIO.off();
+  nd->is_reception_window = false;
+  nd->radio->off();
 
-  if (NETSTACK_RADIO.pending_packet()) {
+  if (nd->radio->pending_packet()) {
     PRINTF("pending packet\n");
-    NETSTACK_RADIO.read(packetbuf_dataptr(), PACKETBUF_SIZE);
+    if (nd->radio->read(packetbuf_dataptr(), PACKETBUF_SIZE) > 0) {
+      nd->rx_stats.flushed++;
+    }
   }
 
-  if (burst_rx_count < BURST_NUM_RXS-1) {
-    burst_rx_count++;
+  if (nd->burst_rx_count < BURST_NUM_RXS-1) {
+    nd->burst_rx_count++;
 
-    rtimer_set(&rt, RTIMER_TIME(&rt) + (BURST_X_SLOT - BURST_X_DUR), 1, burst_rx, NULL);
+    set_timer(nd, RTIMER_TIME(&nd->rt) + (BURST_X_SLOT - nd->sched.burst_x_dur), burst_rx);
   } else {
-    app_cb.nd_epoch_end(epoch_id, epoch_new_nbrs);
-    epoch_id++;
+    epoch_end(nd);
 
-    burst_rx_count = 0; // reset rx counter
+    nd->burst_rx_count = 0; // reset rx counter
 
-    rtimer_set(&rt, RTIMER_TIME(&rt) + (BURST_X_SLOT - BURST_X_DUR), 1, burst_tx, NULL);
+    next_epoch(nd, RTIMER_TIME(&nd->rt) + (BURST_X_SLOT - nd->sched.burst_x_dur));
   }
+
+  ND_PROF_EXIT(ND_PROF_BURST_OFF);
 }
 
 
@@ -183,71 +1059,77 @@ void burst_off(struct rtimer *t, void *ptr)
 /*---------------------------------------------------------------------------*/
 // SCATTER
 
-static uint16_t scatter_tx_count = 0;
-static bool is_epoch_zero = true;
-
 void scatter_rx(struct rtimer *t, void *ptr) 
 {
-  // this callback fn is called at every epoch start, 
-  // but the application must be notified at epoch end
-  if (!is_epoch_zero) { 
-    app_cb.nd_epoch_end(epoch_id, epoch_new_nbrs);
-    epoch_id++;
-    scatter_tx_count = 0;
-  }
-  is_epoch_zero = false;
+  ND_PROF_ENTER(ND_PROF_SCATTER_RX, t);
+  struct nd_instance *nd = ptr;
+
+  // this callback fn is called at every epoch start,
+  // the previous epoch has been closed by its last scatter_tx
+  nd->scatter_tx_count = 0;
 
   // reset discovered neighbours at new epoch
-  reset_epoch();
+  reset_epoch(nd);
+
+  nd->reply_pending = false;
+  nd->is_reception_window = true;
+  nd->radio->on();
 
-  is_reception_window = true;
-  NETSTACK_RADIO.on();
+  window_timer(nd, RTIMER_NOW() + nd->sched.scatter_t_slot, scatter_tx);
 
-  rtimer_set(&rt, RTIMER_NOW() + SCATTER_T_SLOT, 1, scatter_tx, NULL);
+  ND_PROF_EXIT(ND_PROF_SCATTER_RX);
 }
 
 void scatter_tx(struct rtimer *t, void *ptr) 
 {
-  /*if (NETSTACK_RADIO.receiving_packet()) {
+  ND_PROF_ENTER(ND_PROF_SCATTER_TX, t);
+  struct nd_instance *nd = ptr;
+
+  /*if (nd->radio->receiving_packet()) {
     PRINTF("receiving packet\n");
-    rtimer_set(&rt, RTIMER_NOW() + (unsigned)US_TO_RTIMERTICKS(500), 1, scatter_tx, NULL);
+    set_timer(nd, RTIMER_NOW() + (unsigned)US_TO_RTIMERTICKS(500), scatter_tx);
     return;
   }*/
-  if (NETSTACK_RADIO.pending_packet()) {
+  if (nd->radio->pending_packet()) {
     PRINTF("pending packet\n");
-    NETSTACK_RADIO.read(packetbuf_dataptr(), PACKETBUF_SIZE);
+    if (nd->radio->read(packetbuf_dataptr(), PACKETBUF_SIZE) > 0) {
+      nd->rx_stats.flushed++;
+    }
   }
 
-  is_reception_window = false;
-  NETSTACK_RADIO.off();
+  nd->is_reception_window = false;
+  nd->radio->off();
   packetbuf_clear();
 
   radio_value_t radio_status;
-  NETSTACK_RADIO.get_value(RADIO_PARAM_POWER_MODE, &radio_status);
+  nd->radio->get_value(RADIO_PARAM_POWER_MODE, &radio_status);
   if (radio_status == RADIO_POWER_MODE_ON) {
     printf("status: %d\n", radio_status);
-    // NETSTACK_RADIO.off(); // try again?...
+    // nd->radio->off(); // try again?...
   }
 
   unsigned short random_us = random_rand() % (3 * 1000); // up to 3 milliseconds
 
-  /*if (!NETSTACK_RADIO.channel_clear()) {
-    rtimer_set(&rt, RTIMER_NOW() + (BURST_X_SLOT - BURST_X_DELAY) - (unsigned)US_TO_RTIMERTICKS(random_us), 1, scatter_tx, NULL);
+  /*if (!nd->radio->channel_clear()) {
+    set_timer(nd, RTIMER_NOW() + (BURST_X_SLOT - BURST_X_DELAY) - (unsigned)US_TO_RTIMERTICKS(random_us), scatter_tx);
     return;
   }*/
 
-  b.node_id = node_id;
-  int send_status = NETSTACK_RADIO.send(&b, sizeof(b));
+  int send_status = beacon_send(nd);
   if (send_status == RADIO_TX_COLLISION) {
     PRINTF("collision\n");
-    rtimer_set(&rt, RTIMER_TIME(&rt) + SCATTER_X_SLOT - (unsigned)US_TO_RTIMERTICKS(random_us), 1, scatter_tx, NULL);
+    set_timer(nd, RTIMER_TIME(&nd->rt) + nd->sched.scatter_x_slot - (unsigned)US_TO_RTIMERTICKS(random_us), scatter_tx);
+    ND_PROF_EXIT(ND_PROF_SCATTER_TX);
     return;
   }
 
-  if (scatter_tx_count < SCATTER_NUM_TXS-1) {
-    scatter_tx_count++;
-    rtimer_set(&rt, RTIMER_TIME(&rt) + SCATTER_X_SLOT, 1, scatter_tx, NULL);
+  if (nd->scatter_tx_count < nd->sched.scatter_num_txs-1) {
+    nd->scatter_tx_count++;
+    after_beacon(nd, RTIMER_TIME(&nd->rt) + nd->sched.scatter_x_slot, scatter_tx);
   } else {
-    rtimer_set(&rt, RTIMER_TIME(&rt) + SCATTER_X_SLOT, 1, scatter_rx, NULL);
+    // nothing can be received until the next epoch: notify the application now
+    after_beacon(nd, RTIMER_TIME(&nd->rt) + nd->sched.scatter_x_slot, NULL);
   }
+
+  ND_PROF_EXIT(ND_PROF_SCATTER_TX);
 }
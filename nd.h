@@ -1,6 +1,165 @@
 /*---------------------------------------------------------------------------*/
+#include <stdbool.h>
+#include "sys/rtimer.h"
+#include "dev/radio.h"
+/*---------------------------------------------------------------------------*/
 #define ND_BURST 1
 #define ND_SCATTER 2
+#define ND_MODE_MASK 0x0F
+
+/* Option flags, to be OR-ed with the primitive passed to nd_start */
+#define ND_CONTINUOUS 0x10 /* Keep neighbors across epochs, see below */
+#define ND_ADAPTIVE 0x20 /* Switch between burst and scatter, see below */
+#define ND_REACTIVE 0x40 /* Reply to beacons of new neighbors, see below */
+#define ND_TXPOWER 0x80 /* Adjust the TX power every epoch, see below */
+/*---------------------------------------------------------------------------*/
+/* Continuous discovery: a neighbor joins the set after being heard in
+ * ND_JOIN_EPOCHS consecutive epochs and leaves it after ND_AGING_EPOCHS
+ * consecutive epochs without being heard */
+#ifdef ND_CONF_JOIN_EPOCHS
+#define ND_JOIN_EPOCHS ND_CONF_JOIN_EPOCHS
+#else
+#define ND_JOIN_EPOCHS 1
+#endif
+
+#ifdef ND_CONF_AGING_EPOCHS
+#define ND_AGING_EPOCHS ND_CONF_AGING_EPOCHS
+#else
+#define ND_AGING_EPOCHS 3
+#endif
+/*---------------------------------------------------------------------------*/
+/* Adaptive mode: move to scatter (one long rx window, spread out beacons)
+ * when at least ND_ADAPTIVE_DENSE neighbors are found or at least
+ * ND_ADAPTIVE_LOSS percent of the received frames are corrupted or collide,
+ * and back to burst (lower duty cycle) when at most ND_ADAPTIVE_SPARSE
+ * neighbors are found without losses. A switch needs the condition to hold
+ * for ND_ADAPTIVE_EPOCHS consecutive epochs */
+#ifdef ND_CONF_ADAPTIVE_DENSE
+#define ND_ADAPTIVE_DENSE ND_CONF_ADAPTIVE_DENSE
+#else
+#define ND_ADAPTIVE_DENSE 10
+#endif
+
+#ifdef ND_CONF_ADAPTIVE_SPARSE
+#define ND_ADAPTIVE_SPARSE ND_CONF_ADAPTIVE_SPARSE
+#else
+#define ND_ADAPTIVE_SPARSE 5
+#endif
+
+#ifdef ND_CONF_ADAPTIVE_LOSS
+#define ND_ADAPTIVE_LOSS ND_CONF_ADAPTIVE_LOSS
+#else
+#define ND_ADAPTIVE_LOSS 20
+#endif
+
+#ifdef ND_CONF_ADAPTIVE_EPOCHS
+#define ND_ADAPTIVE_EPOCHS ND_CONF_ADAPTIVE_EPOCHS
+#else
+#define ND_ADAPTIVE_EPOCHS 3
+#endif
+/*---------------------------------------------------------------------------*/
+/* Reactive mode: a node hearing a new neighbor in a reception window answers
+ * with a reply beacon within ND_REPLY_JITTER_US (reception windows are
+ * stepped in random ticks of ND_REPLY_JITTER_US/2 to ND_REPLY_JITTER_US),
+ * at most ND_REPLY_BUDGET times per epoch. Every beacon is followed by a
+ * ND_REPLY_GAP_US listen gap to catch the replies. Replies are never
+ * answered */
+#ifdef ND_CONF_REPLY_JITTER_US
+#define ND_REPLY_JITTER_US ND_CONF_REPLY_JITTER_US
+#else
+#define ND_REPLY_JITTER_US 1000
+#endif
+
+#ifdef ND_CONF_REPLY_GAP_US
+#define ND_REPLY_GAP_US ND_CONF_REPLY_GAP_US
+#else
+#define ND_REPLY_GAP_US 3000
+#endif
+
+#ifdef ND_CONF_REPLY_BUDGET
+#define ND_REPLY_BUDGET ND_CONF_REPLY_BUDGET
+#else
+#define ND_REPLY_BUDGET 4
+#endif
+/*---------------------------------------------------------------------------*/
+/* TX power control: at the end of every steady-state epoch the TX power
+ * (RADIO_PARAM_TXPOWER, dBm on the supported radios) is raised by
+ * ND_TXPOWER_STEP while fewer than ND_TXPOWER_TARGET neighbors are found,
+ * and lowered by ND_TXPOWER_STEP when more than ND_TXPOWER_HIGH are found
+ * or at least ND_TXPOWER_LOSS percent of the frames are corrupted or
+ * collide, within RADIO_CONST_TXPOWER_MIN/MAX. It starts from the power the
+ * radio is set to at nd_start */
+#ifdef ND_CONF_TXPOWER_TARGET
+#define ND_TXPOWER_TARGET ND_CONF_TXPOWER_TARGET
+#else
+#define ND_TXPOWER_TARGET 5
+#endif
+
+#ifdef ND_CONF_TXPOWER_HIGH
+#define ND_TXPOWER_HIGH ND_CONF_TXPOWER_HIGH
+#else
+#define ND_TXPOWER_HIGH 15
+#endif
+
+#ifdef ND_CONF_TXPOWER_LOSS
+#define ND_TXPOWER_LOSS ND_CONF_TXPOWER_LOSS
+#else
+#define ND_TXPOWER_LOSS 20
+#endif
+
+#ifdef ND_CONF_TXPOWER_STEP
+#define ND_TXPOWER_STEP ND_CONF_TXPOWER_STEP
+#else
+#define ND_TXPOWER_STEP 3
+#endif
+/*---------------------------------------------------------------------------*/
+/* Data piggybacking: a payload queued with nd_send (NETSTACK_RDC.send for
+ * the upper layers) rides along with every beacon of the next ND_DATA_EPOCHS
+ * full epochs, so that it reaches the neighbors the beacons discover. Up to
+ * ND_SEND_QUEUE_LEN payloads of at most ND_DATA_MAX_LEN bytes are queued.
+ * A received payload is handed up once per sender and sequence number, the
+ * last ND_DATA_SEEN of them are remembered */
+#ifdef ND_CONF_SEND_QUEUE_LEN
+#define ND_SEND_QUEUE_LEN ND_CONF_SEND_QUEUE_LEN
+#else
+#define ND_SEND_QUEUE_LEN 4
+#endif
+
+#ifdef ND_CONF_DATA_MAX_LEN
+#define ND_DATA_MAX_LEN ND_CONF_DATA_MAX_LEN
+#else
+#define ND_DATA_MAX_LEN 16
+#endif
+
+#ifdef ND_CONF_DATA_EPOCHS
+#define ND_DATA_EPOCHS ND_CONF_DATA_EPOCHS
+#else
+#define ND_DATA_EPOCHS 1
+#endif
+
+#if ND_DATA_EPOCHS < 1 || ND_DATA_EPOCHS > 255
+#error "ND_DATA_EPOCHS must be between 1 and 255"
+#endif
+
+#ifdef ND_CONF_DATA_SEEN
+#define ND_DATA_SEEN ND_CONF_DATA_SEEN
+#else
+#define ND_DATA_SEEN 8
+#endif
+
+/* Beacon TX: the beacon is loaded into the radio TX FIFO (prepare) once per
+ * epoch or when its content changes, every beacon then only calls transmit.
+ * Set ND_CONF_TX_REUSE_FIFO to 0 for radios that do not keep the TX FIFO
+ * after a transmission, every beacon is then prepared again */
+#ifdef ND_CONF_TX_REUSE_FIFO
+#define ND_TX_REUSE_FIFO ND_CONF_TX_REUSE_FIFO
+#else
+#define ND_TX_REUSE_FIFO 1
+#endif
+
+#if ND_SEND_QUEUE_LEN > 128 || (ND_SEND_QUEUE_LEN & (ND_SEND_QUEUE_LEN - 1)) != 0
+#error "ND_SEND_QUEUE_LEN must be a power of two up to 128"
+#endif
 /*---------------------------------------------------------------------------*/
 
 #define EPOCH_INTERVAL_RT (RTIMER_SECOND)
@@ -17,35 +176,300 @@
 #define SCATTER_NUM_TXS ((EPOCH_INTERVAL_RT - SCATTER_T_SLOT) / SCATTER_X_SLOT) // 10 times
 
 /*---------------------------------------------------------------------------*/
+/* Bootstrap phase: after nd_start the schedule is boosted for
+ * ND_BOOT_STAGES stages of ND_BOOT_STAGE_EPOCHS epochs each. In stage s the
+ * boost is 2^s: burst sends 2^s times the beacons (BURST_T_DELAY / 2^s
+ * apart) and listens 2^s times longer in each rx window, scatter listens
+ * 2^s times longer (up to half epoch) and spreads 2^s times the beacons
+ * over the rest of the epoch. Stage 0 is the steady BURST_* / SCATTER_*
+ * schedule. When the number of neighbors drops by ND_BOOT_LOSS_PCT percent
+ * from its running average, stage 1 is entered again.
+ * Set ND_CONF_BOOT_STAGES to 0 to disable it */
+#ifdef ND_CONF_BOOT_STAGES
+#define ND_BOOT_STAGES ND_CONF_BOOT_STAGES
+#else
+#define ND_BOOT_STAGES 2
+#endif
+
+#ifdef ND_CONF_BOOT_STAGE_EPOCHS
+#define ND_BOOT_STAGE_EPOCHS ND_CONF_BOOT_STAGE_EPOCHS
+#else
+#define ND_BOOT_STAGE_EPOCHS 5
+#endif
+
+#ifdef ND_CONF_BOOT_LOSS_PCT
+#define ND_BOOT_LOSS_PCT ND_CONF_BOOT_LOSS_PCT
+#else
+#define ND_BOOT_LOSS_PCT 50
+#endif
+
+#if ND_BOOT_STAGES > 2
+#error "ND_BOOT_STAGES above 2 does not fit the burst rx slot"
+#endif
+
+/*---------------------------------------------------------------------------*/
+#ifdef ND_CONF_MAX_NBR
+#define MAX_NBR ND_CONF_MAX_NBR
+#else
 #define MAX_NBR 156 // 64 /* Maximum number of neighbors, 156 on testbed */
+#endif
+
+/* Open-addressing index of a neighbor set, power of two larger than MAX_NBR */
+#ifdef ND_CONF_NBR_HASH_SIZE
+#define ND_NBR_HASH_SIZE ND_CONF_NBR_HASH_SIZE
+#else
+#define ND_NBR_HASH_SIZE 256
+#endif
+
+#if MAX_NBR > 254 || ND_NBR_HASH_SIZE <= MAX_NBR || \
+    (ND_NBR_HASH_SIZE & (ND_NBR_HASH_SIZE - 1)) != 0
+#error "MAX_NBR must be below 255 and ND_NBR_HASH_SIZE a power of two larger than MAX_NBR"
+#endif
+/*---------------------------------------------------------------------------*/
+/* Neighbor set: any 16-bit node id except 0 and 0xFFFF, up to MAX_NBR of
+ * them. ids[0..count-1] holds the neighbors in discovery order, index maps a
+ * node id to its position in ids (position + 1, 0 for an empty slot) */
+struct nd_nbr_set {
+  uint8_t count;
+  uint16_t ids[MAX_NBR];
+  uint8_t index[ND_NBR_HASH_SIZE];
+};
+
+bool nd_nbr_set_contains(const struct nd_nbr_set *set, uint16_t id);
+
+/* Iterate over a set in discovery order:
+ *   for (id = nd_nbr_set_next(set, 0); id != 0; id = nd_nbr_set_next(set, id))
+ * or directly over set->ids[0..count-1]
+ */
+uint16_t nd_nbr_set_next(const struct nd_nbr_set *set, uint16_t prev);
+
+/* out = a \ b (neighbors in a but not in b). out may be a but not b */
+void nd_nbr_set_diff(struct nd_nbr_set *out,
+                     const struct nd_nbr_set *a, const struct nd_nbr_set *b);
 /*---------------------------------------------------------------------------*/
 void nd_recv(void); /* Called by lower layers when a message is received */
 /*---------------------------------------------------------------------------*/
 /* ND callbacks:
  * 	nd_new_nbr: inform the application when a new neighbor is discovered
  *	nd_epoch_end: report to the application the number of neighbors discovered
- *				  at the end of the epoch
+ *				  at the end of the epoch (active neighbors in ND_CONTINUOUS)
+ *	nd_nbr_joined: ND_CONTINUOUS only, a neighbor entered the neighbor set
+ *	nd_nbr_lost: ND_CONTINUOUS only, a neighbor aged out of the neighbor set
+ *	nd_epoch_nbrs: hand the set counted by nd_epoch_end to the application.
+ *				  The set is owned by ND and stays valid (and unchanged) until
+ *				  the end of the following epoch
+ *	nd_data: a payload piggybacked on a beacon of src (see nd_data_input)
+ *
+ * All callbacks get the instance that invokes them (&nd_default behind
+ * nd_start). In ND_CONTINUOUS mode nd_new_nbr is not called. nd_nbr_joined,
+ * nd_nbr_lost, nd_epoch_nbrs and nd_data may be NULL.
  */
+struct nd_instance;
+
 struct nd_callbacks {
-  void (* nd_new_nbr)(uint16_t epoch, uint8_t nbr_id);
-  void (* nd_epoch_end)(uint16_t epoch, uint8_t num_nbr);
+  void (* nd_new_nbr)(struct nd_instance *nd, uint16_t epoch, uint16_t nbr_id);
+  void (* nd_epoch_end)(struct nd_instance *nd, uint16_t epoch, uint8_t num_nbr);
+  void (* nd_nbr_joined)(struct nd_instance *nd, uint16_t epoch, uint16_t nbr_id);
+  void (* nd_nbr_lost)(struct nd_instance *nd, uint16_t epoch, uint16_t nbr_id);
+  void (* nd_epoch_nbrs)(struct nd_instance *nd, uint16_t epoch,
+                         const struct nd_nbr_set *nbrs);
+  void (* nd_data)(struct nd_instance *nd, uint16_t epoch, uint16_t src,
+                   const void *data, uint8_t len);
 };
 /*---------------------------------------------------------------------------*/
-/* Start selected ND primitive (ND_BURST or ND_SCATTER) */
+/* Start selected ND primitive (ND_BURST or ND_SCATTER), optionally OR-ed
+ * with ND_CONTINUOUS, ND_ADAPTIVE, ND_REACTIVE and/or ND_TXPOWER */
 void nd_start(uint8_t mode, const struct nd_callbacks *cb);
+
+/* Switch to ND_BURST or ND_SCATTER at the next epoch boundary. With
+ * ND_ADAPTIVE the automatic policy may switch back later */
+void nd_set_mode(uint8_t mode);
+
+/* Primitive used in the current epoch */
+uint8_t nd_get_mode(void);
+
+/* TX power of the current epoch, as set with RADIO_PARAM_TXPOWER */
+radio_value_t nd_get_txpower(void);
+
+/* Called from the rtimer interrupt once a payload queued with nd_send has
+ * been carried for ND_DATA_EPOCHS epochs, transmissions is the number of
+ * beacons. Delivery is best effort, as for any broadcast: status is
+ * MAC_TX_OK if neighbors were discovered while the payload was carried,
+ * MAC_TX_NOACK if none was and MAC_TX_COLLISION if all beacons collided */
+typedef void (* nd_sent_callback_t)(void *ptr, int status, int transmissions);
+
+/* Queue a payload to ride along with the next beacons, sent may be NULL.
+ * Returns false if the queue is full or the payload too long */
+bool nd_send(const void *data, uint8_t len, nd_sent_callback_t sent, void *ptr);
+
+/* Called by the network driver for a payload handed up by nd_recv: the
+ * payload is in packetbuf, the sender node id in the first two bytes of
+ * PACKETBUF_ADDR_SENDER. Calls nd_data */
+void nd_data_input(void);
+/*---------------------------------------------------------------------------*/
+/* Per-epoch receive statistics: every frame handed to nd_recv is counted in
+ * rx and, if dropped, in the counter of its drop reason */
+struct nd_rx_stats {
+  uint16_t rx;         /* frames handed to nd_recv */
+  uint16_t not_window; /* received outside a reception window */
+  uint16_t bad_len;    /* not a beacon_msg */
+  uint16_t bad_id;     /* node_id 0 or 0xFFFF, or neighbor set full */
+  uint16_t self_id;    /* our own node_id */
+  uint16_t dup;        /* beacon of an already discovered neighbor */
+  uint16_t badcrc;     /* CRC failures reported by the radio (RIMESTATS only) */
+  uint16_t extended;   /* rx windows extended by receiving_packet() */
+  uint16_t flushed;    /* pending frames read and dropped at window end */
+  uint16_t replied;    /* ND_REACTIVE replies sent */
+  uint16_t data;       /* piggybacked payloads handed up */
+};
+
+/* Statistics of the last finished epoch, meant to be read from nd_epoch_end */
+const struct nd_rx_stats *nd_get_rx_stats(void);
 /*---------------------------------------------------------------------------*/
 
+/* beacon_msg flags */
+#define ND_BEACON_REPLY 0x01 /* reply to a beacon, not to be answered */
+#define ND_BEACON_DATA 0x02 /* followed by a sequence number and a payload */
+
 struct beacon_msg
 {
   uint16_t node_id;
-  uint8_t dummy;
+  uint8_t flags;
 } __attribute__((packed));
 
-void reset_epoch();
+#define ND_DATA_HDR_LEN (sizeof(struct beacon_msg) + 1)
+
+/*---------------------------------------------------------------------------*/
+/* Schedule of an epoch: the BURST_* / SCATTER_* values, boosted during the
+ * bootstrap phase */
+struct nd_schedule {
+  uint8_t boost;
+  rtimer_clock_t burst_t_delay;
+  uint8_t burst_num_txs;
+  rtimer_clock_t burst_x_dur;
+  rtimer_clock_t scatter_t_slot;
+  rtimer_clock_t scatter_x_slot;
+  uint8_t scatter_num_txs;
+};
+
+/* Payload queued for piggybacking */
+struct nd_send_entry {
+  nd_sent_callback_t sent;
+  void *ptr;
+  uint8_t seq;
+  uint8_t len;
+  bool started; // carried since the start of an epoch
+  uint8_t epochs;
+  uint8_t nbrs; // most neighbors discovered in one of those epochs
+  uint16_t txs; // beacons that carried it
+  uint16_t collisions;
+  uint8_t data[ND_DATA_MAX_LEN];
+};
+
+/* State of one ND node, private to nd.c. Firmware runs the default instance
+ * behind nd_start / nd_recv; a host simulation can run many nodes in one
+ * process with one instance each (e.g. an array of them). The per-epoch
+ * fields come first, the neighbor sets last */
+struct nd_instance {
+  struct rtimer rt;
+  const struct radio_driver *radio;
+  uint16_t node_id;
+  struct nd_callbacks cb;
+
+  uint8_t mode;
+  uint8_t next_mode; // primitive of the next epoch
+  bool is_transition_epoch; // first epoch after a mode switch
+  volatile bool is_reception_window; // also read by nd_recv
+  bool is_burst_phase; // burst_tx is sending the beacons of the epoch
+  bool is_extended; // the current rx window was extended (counted once)
+  uint8_t burst_tx_count;
+  uint8_t burst_rx_count;
+  uint16_t scatter_tx_count;
+  uint16_t epoch_id;
+  uint8_t epoch_new_nbrs;
+  uint8_t adapt_epochs;
+  uint16_t tx_collisions;
+  uint8_t replies_left;
+
+  // ND_REACTIVE listen gap, see after_beacon
+  rtimer_clock_t gap_next_time;
+  rtimer_callback_t gap_next_cb;
+
+  // ND_REACTIVE reception window, see window_timer
+  rtimer_clock_t win_end;
+  rtimer_callback_t win_cb;
+  volatile bool reply_pending; // set by nd_recv, sent by reply_tick
+
+  struct nd_schedule sched;
+  uint8_t boot_stage;
+  uint8_t boot_epochs;
+  uint16_t avg_nbrs; // running average of the neighbors, x16
 
+  radio_value_t txpower;
+  radio_value_t txpower_min;
+  radio_value_t txpower_max;
+
+  uint8_t frame[ND_DATA_HDR_LEN + ND_DATA_MAX_LEN]; // beacon in the TX FIFO
+  uint8_t frame_len;
+  bool frame_dirty; // TX FIFO to be loaded again
+  struct nd_rx_stats rx_stats; // current epoch
+  struct nd_rx_stats last_rx_stats; // last finished epoch
+  unsigned long last_badcrc; // RIMESTATS only
+
+  /* Send queue: nd_send only moves queue_tail and the rtimer callbacks only
+   * queue_head, both wrap around at 256 */
+  struct nd_send_entry queue[ND_SEND_QUEUE_LEN];
+  uint8_t queue_head;
+  uint8_t queue_tail;
+  uint8_t data_seq;
+  struct {
+    uint16_t id;
+    uint8_t seq;
+  } data_seen[ND_DATA_SEEN]; // payloads already handed up
+  uint8_t data_seen_next;
+
+  /* Double-buffered neighbor set: ids is filled during the epoch while the
+   * application reads the set of the previous epoch */
+  struct nd_nbr_set *ids;
+  struct nd_nbr_set *last_ids;
+  uint8_t active_nbrs;
+  /* ND_CONTINUOUS tracked neighbors, see age_nbrs */
+  uint8_t nbr_state[MAX_NBR];
+  struct nd_nbr_set known_nbrs;
+  struct nd_nbr_set nbr_sets[2];
+};
+
+/* Instance variants of the API above. nd_instance_init clears the instance
+ * and sets the node id and the radio driver, nd_instance_start then resets
+ * the state and starts ND like nd_start (queued payloads are kept).
+ * Data handed to nd_instance_input is copied; it returns ND_DATA_HDR_LEN if
+ * the frame carries a payload to be handed up (found after the header), 0
+ * otherwise. nd_instance_data_input calls nd_data with a payload of src
+ * handed up that way; nd_data_input is its nd_default wrapper */
+void nd_instance_init(struct nd_instance *nd, uint16_t node_id,
+                      const struct radio_driver *radio);
+void nd_instance_start(struct nd_instance *nd, uint8_t mode,
+                       const struct nd_callbacks *cb);
+uint8_t nd_instance_input(struct nd_instance *nd, const void *data, uint16_t len);
+void nd_instance_data_input(struct nd_instance *nd, uint16_t src,
+                            const void *data, uint8_t len);
+void nd_instance_set_mode(struct nd_instance *nd, uint8_t mode);
+uint8_t nd_instance_get_mode(const struct nd_instance *nd);
+radio_value_t nd_instance_get_txpower(const struct nd_instance *nd);
+bool nd_instance_send(struct nd_instance *nd, const void *data, uint8_t len,
+                      nd_sent_callback_t sent, void *ptr);
+const struct nd_rx_stats *nd_instance_get_rx_stats(const struct nd_instance *nd);
+/*---------------------------------------------------------------------------*/
+void reset_epoch(struct nd_instance *nd);
+
+/* rtimer callbacks, ptr is the struct nd_instance (t is NULL when invoked
+ * directly) */
 void burst_tx(struct rtimer *t, void *ptr);
 void burst_rx(struct rtimer *t, void *ptr);
 void burst_off(struct rtimer *t, void *ptr);
 
+void reply_gap_off(struct rtimer *t, void *ptr);
+void reply_tick(struct rtimer *t, void *ptr);
+
 void scatter_tx(struct rtimer *t, void *ptr);
 void scatter_rx(struct rtimer *t, void *ptr);
@@ -0,0 +1,105 @@
+#!/usr/bin/env python3
+
+from __future__ import division
+
+import re
+import sys
+import os.path
+import argparse
+
+def parse_file(log_file, testbed=False):
+    # Print some basic information for the user
+    print(f"Logfile: {log_file}")
+    print(f"{'Cooja simulation' if not testbed else 'Testbed experiment'}\n")
+
+    # Regular expressions
+    if testbed:
+        # Regex for testbed experiments
+        record_pattern = r"\[(?P<time>.{23})\] INFO:firefly\.(?P<self_id>\d+): \d+\.firefly < b'"
+    else:
+        # Regular expressions for COOJA
+        record_pattern = r"(?P<time>[\w:.]+)\s+ID:(?P<self_id>\d+)\s+"
+    regex_clock = re.compile(r"{}Prof: clock (?P<clock>\d+) late (?P<late>\d+)".format(record_pattern))
+    regex_hist = re.compile(r"{}Prof: (?P<epoch>\d+) (?P<cb>\w+) (?P<kind>dur|late) "
+                            r"(?P<cnt>\d+) (?P<min>\d+) (?P<max>\d+) (?P<buckets>[\d ]+)".format(record_pattern))
+
+    # clock frequency of each histogram kind, used to print microseconds
+    hz = {'dur': None, 'late': None}
+
+    # (callback, kind) -> aggregated histogram over all nodes
+    data = {}
+
+    with open(log_file, 'r') as f:
+        for line in f:
+            m = regex_clock.match(line)
+            if m:
+                hz['dur'] = int(m.group('clock'))
+                hz['late'] = int(m.group('late'))
+                continue
+
+            m = regex_hist.match(line)
+            if m:
+                d = m.groupdict()
+                cnt = int(d['cnt'])
+                if cnt == 0:
+                    continue
+                buckets = [int(b) for b in d['buckets'].split()]
+
+                key = (d['cb'], d['kind'])
+                if data.get(key) is None:
+                    data[key] = {
+                        'cnt': 0,
+                        'min': None,
+                        'max': 0,
+                        'buckets': [0] * len(buckets),
+                    }
+                v = data[key]
+                v['cnt'] += cnt
+                v['min'] = int(d['min']) if v['min'] is None else min(v['min'], int(d['min']))
+                v['max'] = max(v['max'], int(d['max']))
+                v['buckets'] = [a + b for a, b in zip(v['buckets'], buckets)]
+
+    def to_us(kind, ticks):
+        if hz[kind] is None:
+            return float('nan')
+        return ticks * 1e6 / hz[kind]
+
+    print("----- ND Callbacks Duration and Lateness -----\n")
+    for (cb, kind) in sorted(data.keys()):
+        v = data[(cb, kind)]
+        print("{:<10} {:<4} n={} min={:.0f}us max={:.0f}us".format(
+            cb, kind, v['cnt'], to_us(kind, v['min']), to_us(kind, v['max'])))
+        for i, b in enumerate(v['buckets']):
+            if b == 0:
+                continue
+            # bucket i holds values with bit length i
+            lo = 0 if i == 0 else 2 ** (i - 1)
+            print("    >= {:>8.0f}us: {:>7} ({:.2%})".format(to_us(kind, lo), b, b / v['cnt']))
+        print("")
+
+
+def parse_args():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('logfile', action="store", type=str,
+                        help="data collection logfile to be parsed and analyzed.")
+    parser.add_argument('-t', '--testbed', action='store_true',
+                        help="flag for testbed experiments")
+    return parser.parse_args()
+
+
+if __name__ == '__main__':
+
+    args = parse_args()
+    print(args)
+
+    if not args.logfile:
+        print("Log file needs to be specified as 1st positional argument.")
+    if not os.path.exists(args.logfile):
+        print("The logfile argument {} does not exist.".format(args.logfile))
+        sys.exit(1)
+    if not os.path.isfile(args.logfile):
+        print("The logfile argument {} is not a file.".format(args.logfile))
+        sys.exit(1)
+
+    # Parse log file and print the histograms
+    parse_file(args.logfile, testbed=args.testbed)
@@ -35,6 +35,11 @@
 #else
 #endif
 
+/*---------------------------------------------------------------------------*/
+/* ND callbacks duration/lateness histograms (see nd-prof.h). On sky this
+ * takes Timer B, which conflicts with the cc2420 SFD timestamps */
+#define ND_PROF_CONF_ENABLED                  0
+#define ND_PROF_CONF_EPOCHS                  10
 /*---------------------------------------------------------------------------*/
 #undef NETSTACK_CONF_RDC
 #define NETSTACK_CONF_RDC      nd_rdc_driver